@@ -0,0 +1,70 @@
+#include "threadpool.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// syscall cost of the pool's signalling paths: futex calls made by cond_lock_t,
+// counted in process, and context switches; `strace -c -f ./bench` gives the full syscall table
+
+#define ROUNDS      100000
+#define FIRES       200000
+#define WORKERS     4
+
+unsigned long lock_futex_calls;
+
+static void *inc(void *x) { return (void*)((intptr_t)x + 1); }
+static void nop(void *x) { (void)x; }
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long
+switches(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static void
+report(const char *name, long n, uint64_t start, unsigned long futex, long csw)
+{
+    double ms = (now_ns() - start) / 1e6;
+    printf("%-28s %8.1f ms  %8.2f futex/op  %8.2f csw/op\n", name, ms,
+            (double)(__atomic_load_n(&lock_futex_calls, __ATOMIC_RELAXED) - futex) / n,
+            (double)(switches() - csw) / n);
+}
+
+int
+main(void)
+{
+    threadpool_t *pool = threadpool_create(WORKERS);
+
+    /* one submit and one blocking get at a time, every step crosses threads */
+    unsigned long futex = lock_futex_calls;
+    long csw = switches();
+    uint64_t start = now_ns();
+    for ( long i = 0; i < ROUNDS; i++ ){
+        threadpool_get(pool, threadpool_gofuture(pool, inc, (void*)i));
+    }
+    report("gofuture+get round trips", ROUNDS, start, futex, csw);
+
+    /* fire and forget, then one join */
+    futex = lock_futex_calls;
+    csw = switches();
+    start = now_ns();
+    for ( long i = 0; i < FIRES; i++ ){
+        threadpool_goroutine(pool, nop, NULL);
+    }
+    threadpool_join(pool);
+    report("goroutines then join", FIRES, start, futex, csw);
+
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    return 0;
+}
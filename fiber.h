@@ -0,0 +1,49 @@
+#ifndef _FIBER_H_
+#define _FIBER_H_
+
+#include "fatalerror.h"
+#include <stddef.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+typedef struct fiber_s {
+    ucontext_t          ctx;
+    /* lowest page is the guard */
+    void                *stack;
+    size_t              stack_size;
+} fiber_t;
+
+/* entry must never return, it switches away for good instead */
+static inline void
+fiber_init(fiber_t *f, size_t stack_size, void (*entry)(void))
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    stack_size = (stack_size + page - 1) / page * page + page;
+
+    f->stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if ( f->stack == MAP_FAILED ) FATALERROR;
+    if ( mprotect(f->stack, page, PROT_NONE) < 0 ) FATALERROR;
+    f->stack_size = stack_size;
+
+    if ( getcontext(&f->ctx) < 0 ) FATALERROR;
+    f->ctx.uc_stack.ss_sp = f->stack;
+    f->ctx.uc_stack.ss_size = stack_size;
+    f->ctx.uc_link = NULL;
+    makecontext(&f->ctx, entry, 0);
+}
+
+static inline void
+fiber_destroy(fiber_t *f)
+{
+    if ( munmap(f->stack, f->stack_size) < 0 ) FATALERROR;
+}
+
+/* saves the running context into from */
+static inline void
+fiber_switch(ucontext_t *from, ucontext_t *to)
+{
+    if ( swapcontext(from, to) < 0 ) FATALERROR;
+}
+
+#endif /* _FIBER_H_ */
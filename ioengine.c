@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include "ioengine.h"
+#include "fatalerror.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* raw syscalls, no liburing needed */
+
+static int
+_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* uring backend */
+
+static void*
+_io_reaper(void *args)
+{
+    io_engine_t *io = (io_engine_t*) args;
+    for ( ; ; ){
+        if ( _uring_enter(io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR ) FATALERROR;
+
+        unsigned head = *io->cq_head;
+        unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+        for ( ; head != tail; head++ ){
+            struct io_uring_cqe *cqe = &io->cqes[ head & *io->cq_mask ];
+            io_request_t *req = (io_request_t*)(uintptr_t) cqe->user_data;
+            /* NULL is the wakeup sent by destroy */
+            if ( !req ) continue;
+            req->done(req, cqe->res);
+            __atomic_sub_fetch(&io->inflight, 1, __ATOMIC_ACQ_REL);
+        }
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+
+        if ( __atomic_load_n(&io->stopping, __ATOMIC_ACQUIRE) && __atomic_load_n(&io->inflight, __ATOMIC_ACQUIRE) == 0 ){
+            return NULL;
+        }
+    }
+}
+
+static int
+_uring_init(io_engine_t *io)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    io->ring_fd = _uring_setup(IO_ENGINE_ENTRIES, &p);
+    if ( io->ring_fd < 0 ) return -1;
+    /* completions could be dropped on overflow before this */
+    if ( !(p.features & IORING_FEAT_NODROP) ){
+        close(io->ring_fd);
+        io->ring_fd = -1;
+        return -1;
+    }
+
+    io->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ( p.features & IORING_FEAT_SINGLE_MMAP ){
+        if ( io->cq_ring_size > io->sq_ring_size ) io->sq_ring_size = io->cq_ring_size;
+        io->cq_ring_size = io->sq_ring_size;
+    }
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+    if ( io->sq_ring == MAP_FAILED ) FATALERROR;
+    io->cq_ring = io->sq_ring;
+    if ( !(p.features & IORING_FEAT_SINGLE_MMAP) ){
+        io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+        if ( io->cq_ring == MAP_FAILED ) FATALERROR;
+    }
+    io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = (struct io_uring_sqe*) mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+    if ( io->sqes == MAP_FAILED ) FATALERROR;
+
+    char *sq = (char*) io->sq_ring, *cq = (char*) io->cq_ring;
+    io->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    io->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned*)(sq + p.sq_off.array);
+    io->cq_head  = (unsigned*)(cq + p.cq_off.head);
+    io->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    io->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    io->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    if ( pthread_create(&io->reaper, NULL, _io_reaper, io) < 0 ) FATALERROR;
+    return 0;
+}
+
+/* lock held, req NULL submits a nop */
+static void
+_uring_submit(io_engine_t *io, io_request_t *req)
+{
+    /* the kernel consumes the entries within io_uring_enter, the ring never fills up */
+    unsigned tail = *io->sq_tail;
+    unsigned idx = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+    if ( req ){
+        switch ( req->op ){
+            case io_op_read:
+                sqe->opcode = IORING_OP_READ;
+                break;
+            case io_op_write:
+                sqe->opcode = IORING_OP_WRITE;
+                break;
+            case io_op_fsync:
+                sqe->opcode = IORING_OP_FSYNC;
+                break;
+            default:
+                assert(0);
+        }
+        sqe->fd = req->fd;
+        sqe->addr = (uintptr_t) req->buf;
+        sqe->len = (unsigned) req->len;
+        sqe->off = (uint64_t) req->off;
+        __atomic_add_fetch(&io->inflight, 1, __ATOMIC_ACQ_REL);
+    }
+    sqe->user_data = (uintptr_t) req;
+    io->sq_array[idx] = idx;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while ( _uring_enter(io->ring_fd, 1, 0, 0) < 0 ){
+        /* completion ring backed up, the reaper is behind */
+        if ( errno == EBUSY || errno == EAGAIN ){
+            sched_yield();
+            continue;
+        }
+        if ( errno != EINTR ) FATALERROR;
+    }
+}
+
+/* fallback backend */
+
+static long
+_io_do(io_request_t *req)
+{
+    ssize_t res = 0;
+    switch ( req->op ){
+        case io_op_read:
+            res = pread(req->fd, req->buf, req->len, req->off);
+            break;
+        case io_op_write:
+            res = pwrite(req->fd, req->buf, req->len, req->off);
+            break;
+        case io_op_fsync:
+            res = fsync(req->fd);
+            break;
+        default:
+            assert(0);
+    }
+    return res < 0 ? -errno : res;
+}
+
+static void*
+_io_worker(void *args)
+{
+    io_engine_t *io = (io_engine_t*) args;
+    for ( ; ; ){
+        cond_lock_lock(&io->lock);
+        while ( !io->head && !io->stopping ){
+            cond_lock_wait(&io->lock);
+        }
+        io_request_t *req = io->head;
+        if ( !req ){
+            /* stopping and drained */
+            cond_lock_unlock(&io->lock);
+            return NULL;
+        }
+        io->head = req->next;
+        if ( !io->head ) io->tail = NULL;
+        cond_lock_unlock(&io->lock);
+
+        req->done(req, _io_do(req));
+    }
+}
+
+void
+io_engine_init(io_engine_t *io, int use_uring)
+{
+    cond_lock_init(&io->lock);
+    io->head = NULL;
+    io->tail = NULL;
+    io->inflight = 0;
+    io->stopping = 0;
+    io->ring_fd = -1;
+    /* ENOSYS, or EPERM under seccomp */
+    if ( use_uring && _uring_init(io) == 0 ) return;
+
+    for ( size_t i = 0; i < IO_ENGINE_FALLBACK_THREADS; i++ ){
+        if ( pthread_create(&io->threads[i], NULL, _io_worker, io) < 0 ) FATALERROR;
+    }
+}
+
+void
+io_engine_submit(io_engine_t *io, io_request_t *req)
+{
+    cond_lock_lock(&io->lock);
+    if ( io->ring_fd >= 0 ){
+        _uring_submit(io, req);
+    }else{
+        req->next = NULL;
+        if ( io->tail ) io->tail->next = req;
+        else io->head = req;
+        io->tail = req;
+        cond_lock_signal(&io->lock);
+    }
+    cond_lock_unlock(&io->lock);
+}
+
+void
+io_engine_destroy(io_engine_t *io)
+{
+    cond_lock_lock(&io->lock);
+    __atomic_store_n(&io->stopping, 1, __ATOMIC_RELEASE);
+    if ( io->ring_fd >= 0 ){
+        /* the reaper may be asleep with nothing in flight */
+        _uring_submit(io, NULL);
+    }else{
+        cond_lock_broadcast(&io->lock);
+    }
+    cond_lock_unlock(&io->lock);
+
+    if ( io->ring_fd >= 0 ){
+        if ( pthread_join(io->reaper, NULL) < 0 ) FATALERROR;
+        if ( munmap(io->sqes, io->sqes_size) < 0 ) FATALERROR;
+        if ( io->cq_ring != io->sq_ring && munmap(io->cq_ring, io->cq_ring_size) < 0 ) FATALERROR;
+        if ( munmap(io->sq_ring, io->sq_ring_size) < 0 ) FATALERROR;
+        close(io->ring_fd);
+    }else{
+        for ( size_t i = 0; i < IO_ENGINE_FALLBACK_THREADS; i++ ){
+            if ( pthread_join(io->threads[i], NULL) < 0 ) FATALERROR;
+        }
+    }
+    cond_lock_destroy(&io->lock);
+}
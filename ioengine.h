@@ -0,0 +1,67 @@
+#ifndef _IOENGINE_H_
+#define _IOENGINE_H_
+
+#include "lock.h"
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#define IO_ENGINE_ENTRIES           256
+#define IO_ENGINE_FALLBACK_THREADS  4
+
+typedef enum {
+    io_op_read,
+    io_op_write,
+    io_op_fsync,
+} io_op_t;
+
+typedef struct io_request_s {
+    io_op_t             op;
+    int                 fd;
+    void                *buf;
+    size_t              len;
+    off_t               off;
+    /* on a completion thread, res is what the syscall returned or -errno */
+    void                (*done)(struct io_request_s *req, long res);
+    struct io_request_s *next;
+} io_request_t;
+
+typedef struct io_engine_s {
+    /* -1 when running on the fallback threads */
+    int                 ring_fd;
+
+    /* rings shared with the kernel */
+    void                *sq_ring;
+    size_t              sq_ring_size;
+    void                *cq_ring;
+    size_t              cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t              sqes_size;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* reaps the completion ring */
+    pthread_t           reaper;
+
+    /* guards the submission ring, or the fallback queue */
+    cond_lock_t         lock;
+    io_request_t        *head;
+    io_request_t        *tail;
+    pthread_t           threads[IO_ENGINE_FALLBACK_THREADS];
+
+    size_t              inflight;
+    int                 stopping;
+} io_engine_t;
+
+/* use_uring = 0 goes straight to the fallback threads */
+void io_engine_init(io_engine_t *io, int use_uring);
+void io_engine_submit(io_engine_t *io, io_request_t *req);
+/* returns once everything submitted has completed */
+void io_engine_destroy(io_engine_t *io);
+
+#endif /* _IOENGINE_H_ */
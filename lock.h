@@ -2,79 +2,187 @@
 #define _LOCK_H_
 
 #include "fatalerror.h"
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* futex based, no syscall unless someone has to sleep or be woken */
 
 typedef struct cond_lock_s {
-    pthread_mutex_t     mut;
-    pthread_cond_t      cond;
+    /* 0 unlocked, 1 locked, 2 locked and maybe waited on */
+    int                 mut;
+    /* bumped by every signal, waiters sleep on it */
+    unsigned            seq;
+    /* sleeping or about to, counted under mut */
+    int                 waiters;
     int                 cond_ok;
 } cond_lock_t;
 
-static inline void 
+#ifdef LOCK_FUTEX_STATS
+/* futex syscalls made so far, defined by the program that asks for them */
+extern unsigned long lock_futex_calls;
+#endif
+
+static inline long
+_futex(void *addr, int op, unsigned val, const struct timespec *ts, unsigned bits)
+{
+#ifdef LOCK_FUTEX_STATS
+    __atomic_add_fetch(&lock_futex_calls, 1, __ATOMIC_RELAXED);
+#endif
+    return syscall(SYS_futex, addr, op | FUTEX_PRIVATE_FLAG, val, ts, NULL, bits);
+}
+
+static inline void
+_futex_wait(void *addr, unsigned val)
+{
+    /* EAGAIN: changed already, EINTR: the caller checks again anyway */
+    if ( _futex(addr, FUTEX_WAIT, val, NULL, 0) < 0 && errno != EAGAIN && errno != EINTR ) FATALERROR;
+}
+
+static inline void
+_futex_wake(void *addr, int cnt)
+{
+    /* EFAULT: wakes come after the unlock, by then the waiter may have freed the word */
+    if ( _futex(addr, FUTEX_WAKE, (unsigned) cnt, NULL, 0) < 0 && errno != EFAULT ) FATALERROR;
+}
+
+static inline void
 cond_lock_init(cond_lock_t *cl)
 {
-    if ( pthread_mutex_init(&cl->mut, NULL) < 0 ) FATALERROR;
-    if ( pthread_cond_init(&cl->cond, NULL) < 0 ) FATALERROR;
+    cl->mut = 0;
+    cl->seq = 0;
+    cl->waiters = 0;
     cl->cond_ok = 0;
 }
 
 static inline void
 cond_lock_destroy(cond_lock_t *cl)
 {
-    if ( pthread_mutex_destroy(&cl->mut) < 0 ) FATALERROR;
-    if ( pthread_cond_destroy(&cl->cond) < 0 ) FATALERROR;
+    /* nothing is held by the kernel */
+    (void) cl;
 }
 
 /* as normal lock */
 static inline void
 cond_lock_lock(cond_lock_t *cl)
 {
-    if ( pthread_mutex_lock(&cl->mut) < 0 ) FATALERROR;
+    int c = 0;
+    if ( __atomic_compare_exchange_n(&cl->mut, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ) return;
+    /* contended, whoever unlocks from now on has to wake */
+    if ( c != 2 ) c = __atomic_exchange_n(&cl->mut, 2, __ATOMIC_ACQUIRE);
+    while ( c != 0 ){
+        _futex_wait(&cl->mut, 2);
+        c = __atomic_exchange_n(&cl->mut, 2, __ATOMIC_ACQUIRE);
+    }
 }
 
 static inline void
 cond_lock_unlock(cond_lock_t *cl)
 {
-    if ( pthread_mutex_unlock(&cl->mut) < 0 ) FATALERROR;
+    if ( __atomic_exchange_n(&cl->mut, 0, __ATOMIC_RELEASE) == 2 ) _futex_wake(&cl->mut, 1);
+}
+
+/* as a monitor, with the lock held */
+static inline void
+cond_lock_wait(cond_lock_t *cl)
+{
+    /* read before letting go, a signal after that changes it */
+    unsigned seq = __atomic_load_n(&cl->seq, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&cl->waiters, 1, __ATOMIC_ACQ_REL);
+    cond_lock_unlock(cl);
+    _futex_wait(&cl->seq, seq);
+    __atomic_sub_fetch(&cl->waiters, 1, __ATOMIC_ACQ_REL);
+    cond_lock_lock(cl);
+}
+
+/* ETIMEDOUT once abstime, on CLOCK_MONOTONIC, passes; the lock is held again either way */
+static inline int
+cond_lock_timedwait(cond_lock_t *cl, const struct timespec *abstime)
+{
+    unsigned seq = __atomic_load_n(&cl->seq, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&cl->waiters, 1, __ATOMIC_ACQ_REL);
+    cond_lock_unlock(cl);
+    /* absolute, unlike FUTEX_WAIT */
+    int res = 0;
+    if ( _futex(&cl->seq, FUTEX_WAIT_BITSET, seq, abstime, FUTEX_BITSET_MATCH_ANY) < 0 ){
+        if ( errno == ETIMEDOUT ) res = ETIMEDOUT;
+        else if ( errno != EAGAIN && errno != EINTR ) FATALERROR;
+    }
+    __atomic_sub_fetch(&cl->waiters, 1, __ATOMIC_ACQ_REL);
+    cond_lock_lock(cl);
+    return res;
+}
+
+static inline void
+cond_lock_signal(cond_lock_t *cl)
+{
+    __atomic_add_fetch(&cl->seq, 1, __ATOMIC_ACQ_REL);
+    if ( __atomic_load_n(&cl->waiters, __ATOMIC_ACQUIRE) > 0 ) _futex_wake(&cl->seq, 1);
+}
+
+static inline void
+cond_lock_broadcast(cond_lock_t *cl)
+{
+    __atomic_add_fetch(&cl->seq, 1, __ATOMIC_ACQ_REL);
+    if ( __atomic_load_n(&cl->waiters, __ATOMIC_ACQUIRE) > 0 ) _futex_wake(&cl->seq, INT_MAX);
 }
 
 /* ee is waiting some condition to continue */
 static inline void
 cond_lock_ee_wait(cond_lock_t *cl)
 {
-    if ( pthread_mutex_lock(&cl->mut) < 0 ) FATALERROR;
+    cond_lock_lock(cl);
     while ( !cl->cond_ok ){
-        if ( pthread_cond_wait(&cl->cond, &cl->mut) < 0 ) FATALERROR;
+        cond_lock_wait(cl);
     }
 }
 
+/* as cond_lock_ee_wait, but holds the lock and returns ETIMEDOUT once abstime passes */
+static inline int
+cond_lock_ee_timedwait(cond_lock_t *cl, const struct timespec *abstime)
+{
+    cond_lock_lock(cl);
+    while ( !cl->cond_ok ){
+        if ( cond_lock_timedwait(cl, abstime) == ETIMEDOUT ) return ETIMEDOUT;
+    }
+    return 0;
+}
+
 static inline void
 cond_lock_ee_finish(cond_lock_t *cl)
 {
     cl->cond_ok = 0;
-    if ( pthread_mutex_unlock(&cl->mut) < 0 ) FATALERROR;
+    cond_lock_unlock(cl);
 }
 
 /* er provides the condiditon */
-static inline void 
+static inline void
 cond_lock_er_lock(cond_lock_t *cl)
 {
-    if ( pthread_mutex_lock(&cl->mut) < 0 ) FATALERROR;
+    cond_lock_lock(cl);
 }
 
-static inline void 
+static inline void
 cond_lock_er_activate(cond_lock_t *cl)
 {
     cl->cond_ok = 1;
-    if ( pthread_mutex_unlock(&cl->mut) < 0 ) FATALERROR;
-    if ( pthread_cond_signal(&cl->cond) < 0 ) FATALERROR;
+    /* bumped and sampled under the lock, a waiter counts itself before letting go of it */
+    __atomic_add_fetch(&cl->seq, 1, __ATOMIC_ACQ_REL);
+    int waiters = __atomic_load_n(&cl->waiters, __ATOMIC_ACQUIRE);
+    cond_lock_unlock(cl);
+    /* only the wake comes after, none counted means nobody to wake */
+    if ( waiters > 0 ) _futex_wake(&cl->seq, 1);
 }
 
 static inline void
 cond_lock_er_disactivate(cond_lock_t *cl)
 {
     cl->cond_ok = 0;
-    if ( pthread_mutex_unlock(&cl->mut) < 0 ) FATALERROR;
+    cond_lock_unlock(cl);
 }
 
 #endif /* _LOCK_H_ */
@@ -0,0 +1,210 @@
+#include "hashtable_memcheck.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+// insert/remove throughput of hashtable_memcheck against the previous
+// separate chaining table (kept below as the reference), keyed by real heap addresses
+
+#define NKEYS       (1 << 20)
+#define ROUNDS      4
+
+/* reference: separate chaining, key % tableSize, malloc per collision node, one-shot rehash */
+
+typedef struct ChainEntry {
+    KEYTYPE key;
+    VALUETYPE value;
+    struct ChainEntry *next;
+} ChainEntry;
+
+typedef struct {
+    size_t tableSize;
+    size_t curSize;
+    ChainEntry *contents;
+} ChainTable;
+
+static ChainTable*
+chainCreate(size_t size)
+{
+    ChainTable *tb = (ChainTable*) malloc(sizeof(ChainTable));
+    tb->tableSize = size;
+    tb->curSize = 0;
+    tb->contents = (ChainEntry*) malloc(sizeof(ChainEntry) * size);
+    for ( size_t i = 0; i < size; i++ ){
+        tb->contents[i].key = NULL;
+        tb->contents[i].next = NULL;
+    }
+    return tb;
+}
+
+static void
+chainDestroy(ChainTable *tb)
+{
+    for ( size_t i = 0; i < tb->tableSize; i++ ){
+        ChainEntry *te = tb->contents[i].next;
+        while ( te ){
+            ChainEntry *next = te->next;
+            free(te);
+            te = next;
+        }
+    }
+    free(tb->contents);
+    free(tb);
+}
+
+static void chainPut(ChainTable *tb, KEYTYPE key, VALUETYPE value);
+
+static void
+chainRehash(ChainTable *tb)
+{
+    ChainTable *newtb = chainCreate(tb->tableSize * 2);
+    for ( size_t i = 0; i < tb->tableSize; i++ ){
+        ChainEntry *bucket = &tb->contents[i];
+        if ( !bucket->key ) continue;
+        chainPut(newtb, bucket->key, bucket->value);
+        ChainEntry *cur = bucket->next;
+        while ( cur ){
+            ChainEntry *next = cur->next;
+            chainPut(newtb, cur->key, cur->value);
+            free(cur);
+            cur = next;
+        }
+    }
+    free(tb->contents);
+    *tb = *newtb;
+    free(newtb);
+}
+
+static void
+chainPut(ChainTable *tb, KEYTYPE key, VALUETYPE value)
+{
+    ChainEntry *bucket = &tb->contents[(size_t)key % tb->tableSize];
+    if ( !bucket->key ){
+        bucket->key = key;
+        bucket->value = value;
+    }else{
+        ChainEntry *prev = bucket;
+        for ( ChainEntry *cur = bucket; cur; prev = cur, cur = cur->next ){
+            if ( cur->key == key ){
+                cur->value = value;
+                return;
+            }
+        }
+        ChainEntry *te = (ChainEntry*) malloc(sizeof(ChainEntry));
+        te->key = key;
+        te->value = value;
+        te->next = NULL;
+        prev->next = te;
+    }
+    if ( ++tb->curSize > 0.75 * tb->tableSize ) chainRehash(tb);
+}
+
+static void
+chainRemove(ChainTable *tb, KEYTYPE key)
+{
+    ChainEntry *bucket = &tb->contents[(size_t)key % tb->tableSize];
+    if ( !bucket->key ) return;
+    if ( bucket->key == key ){
+        if ( bucket->next ){
+            ChainEntry *next = bucket->next;
+            *bucket = *next;
+            free(next);
+        }else{
+            bucket->key = NULL;
+        }
+        tb->curSize--;
+        return;
+    }
+    for ( ChainEntry *prev = bucket, *cur = bucket->next; cur; prev = cur, cur = cur->next ){
+        if ( cur->key == key ){
+            prev->next = cur->next;
+            free(cur);
+            tb->curSize--;
+            return;
+        }
+    }
+}
+
+/* benchmark */
+
+typedef struct {
+    const char *name;
+    void *(*create)(void);
+    void (*destroy)(void*);
+    void (*put)(void*, KEYTYPE, VALUETYPE);
+    void (*remove)(void*, KEYTYPE);
+} table_ops_t;
+
+static void *chainCreateDefault() { return chainCreate(100); }
+static void chainDestroyOp(void *tb) { chainDestroy(tb); }
+static void chainPutOp(void *tb, KEYTYPE key, VALUETYPE value) { chainPut(tb, key, value); }
+static void chainRemoveOp(void *tb, KEYTYPE key) { chainRemove(tb, key); }
+
+static void *rhCreateDefault() { return createHashTable(100); }
+static void rhDestroyOp(void *tb) { destroyHashTable(tb); }
+static void rhPutOp(void *tb, KEYTYPE key, VALUETYPE value) { putKeyValue(tb, key, value); }
+static void rhRemoveOp(void *tb, KEYTYPE key) { removeKey(tb, key); }
+
+static void *keys[NKEYS];
+/* frees don't come back in allocation order */
+static void *shuffled[NKEYS];
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+bench(const table_ops_t *ops)
+{
+    VALUETYPE v = { NULL, 32, 0 };
+    double insert = 0, removal = 0, worst = 0;
+
+    for ( int r = 0; r < ROUNDS; r++ ){
+        void *tb = ops->create();
+        double t0 = now();
+        for ( size_t i = 0; i < NKEYS; i++ ) ops->put(tb, keys[i], v);
+        insert += now() - t0;
+        t0 = now();
+        for ( size_t i = 0; i < NKEYS; i++ ) ops->remove(tb, shuffled[i]);
+        removal += now() - t0;
+        ops->destroy(tb);
+    }
+
+    /* separate pass, the timing calls would distort the throughput above */
+    void *tb = ops->create();
+    for ( size_t i = 0; i < NKEYS; i++ ){
+        double t0 = now();
+        ops->put(tb, keys[i], v);
+        double dt = now() - t0;
+        if ( dt > worst ) worst = dt;
+    }
+    ops->destroy(tb);
+
+    printf("%-10s insert %7.1f Mops/s  remove %7.1f Mops/s  worst insert %9.1f us\n", ops->name,
+            NKEYS * (double)ROUNDS / insert / 1e6, NKEYS * (double)ROUNDS / removal / 1e6, worst * 1e6);
+}
+
+int
+main()
+{
+    table_ops_t chaining  = { "chaining", chainCreateDefault, chainDestroyOp, chainPutOp, chainRemoveOp };
+    table_ops_t robinhood = { "robinhood", rhCreateDefault, rhDestroyOp, rhPutOp, rhRemoveOp };
+
+    for ( size_t i = 0; i < NKEYS; i++ ) keys[i] = shuffled[i] = malloc(32);
+    srand(1);
+    for ( size_t i = NKEYS - 1; i > 0; i-- ){
+        size_t j = (size_t)rand() % (i + 1);
+        void *tmp = shuffled[i];
+        shuffled[i] = shuffled[j];
+        shuffled[j] = tmp;
+    }
+    bench(&chaining);
+    bench(&robinhood);
+    for ( size_t i = 0; i < NKEYS; i++ ) free(keys[i]);
+    return 0;
+}
@@ -1,206 +1,261 @@
 #include "hashtable_memcheck.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
-// This is a hashtable hashing a string to a function pointer
+// This is a hashtable hashing a heap address to its allocation record
 
 // The implementation is based on these considerations:
-// 1, If we keep rehashing when a threshold point is reached, then almost all elements are stored in a bucket with only one element
+// 1, Open addressing with robin hood probing keeps every record in one flat array, no malloc per collision
+// 2, Deletion shifts the following cluster back by one slot, so there are never tombstones
+// 3, Rehash is incremental: the old array is drained a few slots per put/remove instead of all at once,
+//    so no single allocation pays for copying the whole table
+// The price is insert throughput: the hash scatters addresses that malloc hands out in order, so
+// each insert misses the cache where key % tableSize kept walking adjacent buckets. See 'make bench'.
 
 //#define DEBUG_HASHTABLE
 
 static const double rehashThreshold  = 0.75;
 static const unsigned int rehashRate = 2;
-
-static void _rehash(HashTable *tb);
+// slots of the old array walked per put/remove while rehashing
+static const size_t migrateStep      = 8;
 
 static size_t
-defaultHashFunc(const KEYTYPE key, size_t tableSize)
+defaultHashFunc(const KEYTYPE key)
 {
 #ifdef KEYTYPESTRING
     size_t sum = 0;
     while ( *key ){
         sum = 37 * sum + *key++;
     }
-    return sum % tableSize;
+    return sum;
 #else
-    return (size_t)key % tableSize;
+    // murmur3 finalizer, aligned heap pointers have their low bits all zero
+    uint64_t h = (uint64_t)(uintptr_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb53dcd1a85a3ull;
+    h ^= h >> 33;
+    return (size_t)h;
 #endif
 }
 
-HashTable*
-createHashTable(size_t size)
+static size_t
+_roundUpPower2(size_t size)
 {
-    // defensive
-    if ( size == 0 ) size = 1;
-    HashTable* tb = (HashTable*) malloc(sizeof(HashTable));
-    tb->tableSize = size;
-    tb->curSize = 0;
-    tb->hashFunc = defaultHashFunc;
-// #if defined KEYTYPESTRING && NONEXISTKEY == NULL
-//     tb->contents = (TableEntry*) calloc(size, sizeof(TableEntry));
-// #else
-    tb->contents = (TableEntry*) malloc(sizeof(TableEntry) * size);
-    for ( size_t i = 0; i < size; i++ ){
-        tb->contents[i].key = (KEYTYPE)NONEXISTKEY;
-        tb->contents[i].next = NULL;
-    }
-// #endif
-    return tb;
+    size_t res = 1;
+    while ( res < size ) res <<= 1;
+    return res;
 }
 
 static void
-_destroyHashTable(HashTable *tb, int destroyKey)
+_initSlots(TableSlots *ts, size_t size)
 {
-    for ( size_t i = 0; i < tb->tableSize; i++ ){
-        if ( ISNONEXISTKEY(tb->contents[i].key) ) continue;
-        
-        // destroy the whole linked list
-        if ( destroyKey ) FREEKEY( tb->contents[i].key );
-        TableEntry *te = tb->contents[i].next;
-        while ( te ){
-            TableEntry *teNext = te->next;
-            if ( destroyKey ) FREEKEY(te->key);
-            free(te);
-            te = teNext;
-        }
-    }
-    free(tb->contents);
+    ts->tableSize = size;
+    ts->curSize = 0;
+    // NONEXISTKEY is all zero bits: fresh pages come zeroed, no O(n) init on rehash
+    ts->contents = (TableEntry*) calloc(size, sizeof(TableEntry));
 }
 
-void
-destroyHashTable(HashTable *tb){
-    _destroyHashTable(tb, 1);
-    free(tb);
+// distance of the entry in slot i from its home slot
+static size_t
+_probeDistance(HashTable *tb, TableSlots *ts, size_t i)
+{
+    size_t mask = ts->tableSize - 1;
+    return (i - (tb->hashFunc(ts->contents[i].key) & mask)) & mask;
 }
 
-// if this key doesn't exist, we do nothing and just return 
-void
-removeKey(HashTable *tb, const KEYTYPE key)
+// the key is known to be absent from ts
+static void
+_slotsInsert(HashTable *tb, TableSlots *ts, TableEntry te)
 {
-    struct TableEntry* thisBucket = &tb->contents[tb->hashFunc(key, tb->tableSize)];
-    
-    // it's the head ?
-    if ( ISNONEXISTKEY(thisBucket->key) ) return;
-    if ( ISEQUALKEY(thisBucket->key, key) ){
-        FREEKEY(thisBucket->key);
-        if ( thisBucket->next ) {
-            TableEntry *nextOne = thisBucket->next;
-            thisBucket->key = nextOne->key;
-            thisBucket->value = nextOne->value;
-            thisBucket->next = nextOne->next;
-            free(nextOne);
-        }else{
-            thisBucket->key = (KEYTYPE)NONEXISTKEY;
-        }
-        tb->curSize--;
-        return;
-    }
-
-    struct TableEntry *prev = thisBucket, *cur = thisBucket->next;
-    while ( cur ){
-        if ( ISEQUALKEY(cur->key, key) ){
-            // found
-            prev->next = cur->next;
-            FREEKEY(cur->key);
-            free(cur);
-            tb->curSize--;
+    size_t mask = ts->tableSize - 1;
+    size_t i = tb->hashFunc(te.key) & mask, dist = 0;
+    for ( ; ; i = (i + 1) & mask, dist++ ){
+        TableEntry *e = &ts->contents[i];
+        if ( ISNONEXISTKEY(e->key) ){
+            *e = te;
+            ts->curSize++;
             return;
         }
-        prev = cur;
-        cur = cur->next;
+        // rich entry gives its slot to the poor one
+        size_t edist = _probeDistance(tb, ts, i);
+        if ( edist < dist ){
+            TableEntry tmp = *e;
+            *e = te;
+            te = tmp;
+            dist = edist;
+        }
     }
 }
 
-static struct TableEntry*
-_createTableEntry( const KEYTYPE key, VALUETYPE value, int copyKey )
+// returns the slot index of key, or tableSize if absent
+static size_t
+_slotsFind(HashTable *tb, TableSlots *ts, const KEYTYPE key)
 {
-    struct TableEntry *res = (struct TableEntry*) malloc(sizeof(struct TableEntry));
-    if ( copyKey ){
-        DEEPCOPYKEY(res->key, key);
-    }else{
-        res->key = (KEYTYPE)key;
+    if ( !ts->contents ) return ts->tableSize;
+    size_t mask = ts->tableSize - 1;
+    size_t i = tb->hashFunc(key) & mask, dist = 0;
+    for ( ; ; i = (i + 1) & mask, dist++ ){
+        TableEntry *e = &ts->contents[i];
+        if ( ISNONEXISTKEY(e->key) ) return ts->tableSize;
+        if ( ISEQUALKEY(e->key, key) ) return i;
+        // key would have displaced this entry
+        if ( _probeDistance(tb, ts, i) < dist ) return ts->tableSize;
     }
-    res->value = value;
-    res->next = NULL;
-    return res;
 }
 
+// backward shift deletion
 static void
-_putTableEntry(HashTable *tb, TableEntry *te)
+_slotsRemoveAt(HashTable *tb, TableSlots *ts, size_t i)
 {
-    TableEntry* thisBucket = &tb->contents[tb->hashFunc(te->key, tb->tableSize)];
-    
-    if ( ISNONEXISTKEY(thisBucket->key) ){
-        thisBucket->key = te->key;
-        thisBucket->value = te->value;
-        free(te);
-        assert(thisBucket->next == NULL);
-        return;
+    size_t mask = ts->tableSize - 1;
+    FREEKEY(ts->contents[i].key);
+    for ( ; ; ){
+        size_t next = (i + 1) & mask;
+        if ( ISNONEXISTKEY(ts->contents[next].key) || _probeDistance(tb, ts, next) == 0 ) break;
+        ts->contents[i] = ts->contents[next];
+        i = next;
     }
-    te->next = thisBucket->next;
-    thisBucket->next = te;
+    ts->contents[i].key = (KEYTYPE)NONEXISTKEY;
+    ts->curSize--;
+}
+
+static int
+_isRehashing(HashTable *tb)
+{
+    return tb->old.contents != NULL;
+}
+
+// slots of old already walked keep their (stale) content, so probing through them still works
+static int
+_isMigrated(HashTable *tb, size_t i)
+{
+    return ((i - tb->migrateStart) & (tb->old.tableSize - 1)) < tb->migrated;
+}
+
+// returns the slot index of key in the not yet migrated part of old, or old.tableSize if absent
+static size_t
+_oldFind(HashTable *tb, const KEYTYPE key)
+{
+    size_t i = _slotsFind(tb, &tb->old, key);
+    if ( i != tb->old.tableSize && _isMigrated(tb, i) ) return tb->old.tableSize;
+    return i;
 }
 
-// if this key already exists, then just update its value
 static void
-_putKeyValue(HashTable *tb, const KEYTYPE key, VALUETYPE value, int copyKey)
+_migrate(HashTable *tb, size_t steps)
 {
-    struct TableEntry* thisBucket = &tb->contents[tb->hashFunc(key, tb->tableSize)];
-    
-    // handle the head
-    if ( ISNONEXISTKEY(thisBucket->key) ){
-        // new key
-        if ( copyKey ){
-            DEEPCOPYKEY(thisBucket->key, key);
-        }else{
-            thisBucket->key = (KEYTYPE)key;
-        }
-        thisBucket->value = value;
-        if ( ++tb->curSize > rehashThreshold * tb->tableSize ) _rehash(tb);
-        return;
+    if ( !_isRehashing(tb) ) return;
+    size_t mask = tb->old.tableSize - 1;
+    while ( steps-- > 0 && tb->migrated < tb->old.tableSize ){
+        TableEntry *e = &tb->old.contents[ (tb->migrateStart + tb->migrated) & mask ];
+        tb->migrated++;
+        if ( ISNONEXISTKEY(e->key) ) continue;
+        _slotsInsert(tb, &tb->cur, *e);
+        tb->old.curSize--;
     }
-    if ( ISEQUALKEY(thisBucket->key, key) ){
-        // update
-        thisBucket->value = value;
-        return;
+    if ( tb->migrated == tb->old.tableSize ){
+        assert( tb->old.curSize == 0 );
+        free(tb->old.contents);
+        tb->old.contents = NULL;
     }
+}
 
-    struct TableEntry *prev = thisBucket, *cur = thisBucket->next;
-    while ( cur ){
-        // update
-        if ( ISEQUALKEY(cur->key, key) ){
-            cur->value = value;
-            return;
-        }
-        prev = cur;
-        cur = cur->next;
+static void
+_rehash(HashTable *tb)
+{
+    // a previous rehash must be done before the current array retires
+    _migrate(tb, (size_t)-1);
+
+    tb->old = tb->cur;
+    _initSlots(&tb->cur, tb->old.tableSize * rehashRate);
+
+    // start walking at an empty slot, no cluster wraps around it
+    tb->migrateStart = 0;
+    while ( !ISNONEXISTKEY(tb->old.contents[tb->migrateStart].key) ){
+        tb->migrateStart++;
     }
+    tb->migrated = 0;
+}
 
-    // a new key
-    prev->next = _createTableEntry(key, value, copyKey);
-    if ( ++tb->curSize > rehashThreshold * tb->tableSize ) _rehash(tb);
+HashTable*
+createHashTable(size_t size)
+{
+    // defensive
+    if ( size < 2 ) size = 2;
+    HashTable* tb = (HashTable*) malloc(sizeof(HashTable));
+    tb->hashFunc = defaultHashFunc;
+    _initSlots(&tb->cur, _roundUpPower2(size));
+    tb->old.tableSize = 0;
+    tb->old.curSize = 0;
+    tb->old.contents = NULL;
+    tb->migrateStart = 0;
+    tb->migrated = 0;
+    return tb;
 }
 
+static void
+_destroySlots(TableSlots *ts)
+{
+    if ( !ts->contents ) return;
+    for ( size_t i = 0; i < ts->tableSize; i++ ){
+        if ( !ISNONEXISTKEY(ts->contents[i].key) ) FREEKEY( ts->contents[i].key );
+    }
+    free(ts->contents);
+}
+
+void
+destroyHashTable(HashTable *tb){
+    _migrate(tb, (size_t)-1);
+    _destroySlots(&tb->cur);
+    free(tb);
+}
+
+// if this key doesn't exist, we do nothing and just return
+void
+removeKey(HashTable *tb, const KEYTYPE key)
+{
+    size_t i = _slotsFind(tb, &tb->cur, key);
+    if ( i != tb->cur.tableSize ){
+        _slotsRemoveAt(tb, &tb->cur, i);
+    }else if ( _isRehashing(tb) && (i = _oldFind(tb, key)) != tb->old.tableSize ){
+        _slotsRemoveAt(tb, &tb->old, i);
+    }
+    _migrate(tb, migrateStep);
+}
+
+// if this key already exists, then just update its value
 void
 putKeyValue(HashTable *tb, const KEYTYPE key, VALUETYPE value)
 {
-    _putKeyValue(tb, key, value, 1);
+    size_t i = _slotsFind(tb, &tb->cur, key);
+    if ( i != tb->cur.tableSize ){
+        // update
+        tb->cur.contents[i].value = value;
+    }else if ( _isRehashing(tb) && (i = _oldFind(tb, key)) != tb->old.tableSize ){
+        // update, it will be moved by migration
+        tb->old.contents[i].value = value;
+    }else{
+        // a new key
+        if ( tb->cur.curSize + 1 > rehashThreshold * tb->cur.tableSize ) _rehash(tb);
+        TableEntry te;
+        DEEPCOPYKEY(te.key, key);
+        te.value = value;
+        _slotsInsert(tb, &tb->cur, te);
+    }
+    _migrate(tb, migrateStep);
 }
 
 TableEntry*
 findKey(HashTable *tb, const KEYTYPE key)
 {
-    struct TableEntry *thisBucket = &tb->contents[tb->hashFunc(key, tb->tableSize)],
-    *walker = thisBucket->next;
-    if ( !ISNONEXISTKEY(thisBucket->key) && ISEQUALKEY(thisBucket->key, key) ) return thisBucket;
-    
-    while ( walker ){
-        if ( ISEQUALKEY(walker->key, key) ) return walker;
-        walker = walker->next;
-    }
+    size_t i = _slotsFind(tb, &tb->cur, key);
+    if ( i != tb->cur.tableSize ) return &tb->cur.contents[i];
+    if ( _isRehashing(tb) && (i = _oldFind(tb, key)) != tb->old.tableSize ) return &tb->old.contents[i];
     return NULL;
 }
 
@@ -210,73 +265,30 @@ hasKey(HashTable *tb, const KEYTYPE key)
     return findKey(tb, key) != NULL;
 }
 
-VALUETYPE
+VALUETYPE*
 findValueByKey(HashTable *tb, const KEYTYPE key)
 {
     TableEntry* te = findKey(tb, key);
-    if ( te ) return te->value;
-    return (VALUETYPE)NONEXISTVALUE;
-}
-
-static void
-_rehash(HashTable *tb)
-{
-    HashTable *newtb = createHashTable(tb->tableSize * rehashRate);
-    for ( size_t i = 0; i < tb->tableSize; i++ ){
-        TableEntry *thisBucket = &tb->contents[i];
-        
-        // the head TableEntry cannot be put to other place
-        if ( ISNONEXISTKEY(thisBucket->key) ) continue;
-        _putKeyValue(newtb, thisBucket->key, thisBucket->value, 0);
-        
-        TableEntry *cur = thisBucket->next;
-        while (cur){
-            TableEntry *tmp = cur->next;
-            _putTableEntry(newtb, cur);
-            cur = tmp;
-        }
-    }
-    
-    // now all memory allocated by the lifecycle of tb is tb->contents
-    free(tb->contents);
-    tb->tableSize = newtb->tableSize;
-    tb->contents = newtb->contents;
-    free(newtb);
+    if ( te ) return &te->value;
+    return NULL;
 }
 
 static void
-_gotoNext(HashTableIter *ite)
+_skipEmpty(HashTableIter *ite)
 {
-    if ( ite->curPoint == ite->endPoint ) return;
-    assert(ite->inBucketPoint);
-    
-    ite->inBucketPoint = ite->inBucketPoint->next;
-    if ( ite->inBucketPoint ) return;
-    
-    while ( ++ite->curPoint != ite->endPoint && ISNONEXISTKEY(ite->curPoint->key) )
-        ;
-    if ( ite->curPoint != ite->endPoint ){
-        ite->inBucketPoint = ite->curPoint;
-    }else{
-        ite->inBucketPoint = NULL;
+    while ( ite->curPoint != ite->endPoint && ISNONEXISTKEY(ite->curPoint->key) ){
+        ite->curPoint++;
     }
-    return;
 }
 
 HashTableIter*
 getHashTableIter(HashTable *tb)
 {
+    _migrate(tb, (size_t)-1);
     HashTableIter *ite = (HashTableIter*) malloc(sizeof(HashTableIter));
-    ite->endPoint = tb->contents + tb->tableSize;
-    ite->curPoint = tb->contents;
-    while ( ite->curPoint != ite->endPoint && ISNONEXISTKEY(ite->curPoint->key) ){
-        ite->curPoint++;
-    }
-    if ( ite->curPoint != ite->endPoint ){
-        ite->inBucketPoint = ite->curPoint;
-    }else{
-        ite->inBucketPoint = NULL;
-    }
+    ite->endPoint = tb->cur.contents + tb->cur.tableSize;
+    ite->curPoint = tb->cur.contents;
+    _skipEmpty(ite);
     return ite;
 }
 
@@ -296,101 +308,64 @@ TableEntry*
 nextElement(HashTableIter *ite)
 {
     if ( ite->curPoint == ite->endPoint ) return NULL;
-    TableEntry *res = ite->curPoint;
-    _gotoNext(ite);
+    TableEntry *res = ite->curPoint++;
+    _skipEmpty(ite);
     return res;
 }
 
 size_t
 getHashTableSize(HashTable *tb)
 {
-    return tb->curSize;
+    return tb->cur.curSize + tb->old.curSize;
 }
 
 
 #ifdef DEBUG_HASHTABLE
-static void
-printHashTable(HashTable *tb)
-{
-    printf("HashTable: size = %d, curSize = %d\n", tb->tableSize, tb->curSize);
-    for ( size_t i = 0; i < tb->tableSize; i++ ){
-        struct TableEntry *thisBucket = &tb->contents[i];
-        if ( thisBucket->key ){
-            printf("           hashcode: %d\n", i);
-            struct TableEntry *cur = thisBucket;
-            while (cur){
-                printf("             key = \"%s\", value = %p\n", cur->key, cur->value);
-                cur = cur->next;
-            }
-        }
-    }
-}
-
-static void
-putAndShowPutMsg(HashTable *tb, const char *s, void* p)
+static VALUETYPE
+_value(size_t sz)
 {
-    printf("### putting \"%s\", %p ...\n", s, p);
-    putKeyValue(tb, s, p);
-}
-
-static void
-removeAndShow(HashTable *tb, const char *s)
-{
-    printf("### removing \"%s\" ...\n", s);
-    removeKey(tb, s);
+    VALUETYPE v = { NULL, sz, 0 };
+    return v;
 }
 
 void
 test()
 {
     HashTable *tb = createHashTable(1);
-    void *ptr1, *ptr2;
-
-    putAndShowPutMsg(tb, "hello world", (void*)0x101);
-    ptr1 = findValueByKey(tb, "hello world");
-    assert(ptr1 == (void*)0x101);
-    printHashTable(tb);
-
-    putAndShowPutMsg(tb, "goodmorning", (void*)0x932);
-    printHashTable(tb);
-
-    putAndShowPutMsg(tb, "this is a good day", (void*)0x9999);
-    printHashTable(tb);
-
-    putAndShowPutMsg(tb, "writing", (void*)0x8888);
-    printHashTable(tb);
-    
-    putAndShowPutMsg(tb, "falling", (void*)0x777);
-    printHashTable(tb);
-
-    removeAndShow(tb, "goodmorning");
-    removeAndShow(tb, "hello world");
-    printHashTable(tb);
-
-    putAndShowPutMsg(tb, "hello world", (void*)0x1221432);
-    printHashTable(tb);
-    
-    putAndShowPutMsg(tb, "falling", (void*)0x23412343);
-    printHashTable(tb);
-    assert( findValueByKey(tb, "falling") == (void*)0x23412343 );
-    assert( findValueByKey(tb, "goodmorning") == NULL );
-    
-    putAndShowPutMsg(tb, "goodmorning", (void*)0x9876);
-    assert( findValueByKey(tb, "goodmorning") == (void*)0x9876);
-
-    putAndShowPutMsg(tb, "cpp", (void*)0x123);
-    putAndShowPutMsg(tb, "java", (void*)0x1252);
-    printHashTable(tb);
-    
+    static char heap[1 << 16];
+
+    // enough keys to go through several incremental rehashes
+    for ( size_t i = 0; i < sizeof(heap) / 16; i++ ){
+        putKeyValue(tb, heap + i * 16, _value(i));
+        assert( getHashTableSize(tb) == i + 1 );
+    }
+    for ( size_t i = 0; i < sizeof(heap) / 16; i++ ){
+        assert( findValueByKey(tb, heap + i * 16)->size == i );
+    }
+
+    // remove every odd one while the last rehash may still be in flight
+    for ( size_t i = 1; i < sizeof(heap) / 16; i += 2 ){
+        removeKey(tb, heap + i * 16);
+    }
+    for ( size_t i = 0; i < sizeof(heap) / 16; i++ ){
+        assert( hasKey(tb, heap + i * 16) == (i % 2 == 0) );
+    }
+
+    putKeyValue(tb, heap, _value(12345));
+    assert( findValueByKey(tb, heap)->size == 12345 );
+
+    size_t cnt = 0;
     HashTableIter *iter = getHashTableIter(tb);
     while ( hasNextElement(iter) ){
         TableEntry *te = nextElement(iter);
-        printf("*** key = \"%s\", value = %p\n", te->key, te->value);
+        assert( ((char*)te->key - heap) % 32 == 0 );
+        cnt++;
     }
     destroyHashTableIter(iter);
+    assert( cnt == getHashTableSize(tb) );
 
+    printf("curSize: %lu\n", getHashTableSize(tb));
     destroyHashTable(tb);
-    printf("curSize: %d\n", getHashTableSize(tb));
     printf("done...\n");
 }
 
@@ -4,15 +4,18 @@
 #include <stddef.h>
 #include <stdlib.h>
 
+struct memcheck_site_s;
+
 typedef struct memcheck_source_s {
-    const char      *filename;
-    size_t          lineno;
-    const char      *funcname;
+    /* interned (file, line, func) of the allocation */
+    struct memcheck_site_s *site;
     size_t          size;
+    /* bytes charged to the site's profile, 0 if profiling was off */
+    size_t          charged;
 } memcheck_source_t;
 
-#define VALUETYPE               memcheck_source_t*
-#define NONEXISTVALUE           NULL
+/* stored inline in the entry, no allocation per record */
+#define VALUETYPE               memcheck_source_t
 
 // #define KEYTYPESTRING
 
@@ -46,20 +49,28 @@ typedef struct memcheck_source_s {
 typedef struct TableEntry {
     KEYTYPE key;
     VALUETYPE value;
-    struct TableEntry *next;
 } TableEntry;
 
-typedef struct {
+/* one open-addressing array, robin hood probing, tableSize is a power of two */
+typedef struct TableSlots {
     size_t tableSize;
     size_t curSize;
-    size_t (*hashFunc)(const KEYTYPE, size_t);
     struct TableEntry *contents;
+} TableSlots;
+
+typedef struct {
+    size_t (*hashFunc)(const KEYTYPE);
+    // all insertions go here
+    TableSlots cur;
+    // while rehashing, the retiring array; contents == NULL otherwise
+    TableSlots old;
+    size_t migrateStart;
+    size_t migrated;
 } HashTable;
 
 typedef struct HashTableIter {
     TableEntry *endPoint;
     TableEntry *curPoint;
-    TableEntry *inBucketPoint;
 } HashTableIter;
 
 #define createHashTable createHashTable_memcheck
@@ -87,10 +98,12 @@ void putKeyValue(HashTable *tb, const KEYTYPE key, VALUETYPE value);
 
 int hasKey(HashTable *tb, const KEYTYPE key);
 TableEntry *findKey(HashTable *tb, const KEYTYPE key);
-VALUETYPE findValueByKey(HashTable *tb, const KEYTYPE key);
+/* NULL if key doesn't exist, otherwise points into the table until next put/remove */
+VALUETYPE *findValueByKey(HashTable *tb, const KEYTYPE key);
 
 size_t getHashTableSize(HashTable *tb);
 
+/* finishes any pending rehash first */
 HashTableIter *getHashTableIter(HashTable *tb);
 void destroyHashTableIter(HashTableIter *ite);
 int hasNextElement(HashTableIter *ite);
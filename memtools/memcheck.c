@@ -2,49 +2,260 @@
 #include "hashtable_memcheck.h"
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
 
-static HashTable *mem_dict;
+/* allocations are spread over independently locked shards by address */
+#ifndef MEMCHECK_SHARDS
+#define MEMCHECK_SHARDS         16
+#endif
+
+#if MEMCHECK_SHARDS & (MEMCHECK_SHARDS - 1)
+#error "MEMCHECK_SHARDS must be a power of two"
+#endif
+
+/* direct mapped, per shard, so the hot path never touches the global site registry */
+#define SITE_CACHE_SIZE         64
+#define SITE_REGISTRY_SIZE      1024
+
+typedef struct memcheck_shard_s {
+    HashTable           *mem_dict;
+#ifdef MEMCHECK_MULTITHREAD
+    pthread_mutex_t     lock;
+#endif
+    memcheck_site_t     *site_cache[SITE_CACHE_SIZE];
+    /* bytes charged by records of this shard, read by the sampler without the lock */
+    size_t              live_bytes;
+} __attribute__((aligned(64))) memcheck_shard_t;
+
+static memcheck_shard_t shards[MEMCHECK_SHARDS];
 const size_t init_size = 100;
 static int isinit;
-static pthread_mutex_t big_lock; 
+
+/* site registry, sites live until memcheck_finalize */
+static memcheck_site_t  *site_registry[SITE_REGISTRY_SIZE];
+static size_t           site_count;
+static pthread_mutex_t  site_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int              profiling;
+static size_t           peak_total;
+
+/* sampling mode, 0 tracks every allocation */
+static size_t           sample_rate;
+/* per thread countdown to the next sampled allocation */
+static __thread long    bytes_until_sample;
+static __thread int     sample_countdown_init;
+static __thread uint64_t sample_rng;
+/* counting filter over sampled addresses, a zero bucket means free can skip the lock */
+#define SAMPLE_FILTER_SIZE      (1 << 16)
+static unsigned         sample_filter[SAMPLE_FILTER_SIZE];
+
+/* background sampler */
+static pthread_t        sampler;
+static int              sampler_running;
+static unsigned         sampler_interval_ms;
+static FILE             *sampler_out;
+
+#ifdef MEMCHECK_MULTITHREAD
+#define SHARD_LOCK(sh)      if ( pthread_mutex_lock(&(sh)->lock) < 0 ) FATALERROR
+#define SHARD_UNLOCK(sh)    if ( pthread_mutex_unlock(&(sh)->lock) < 0 ) FATALERROR
+#else
+#define SHARD_LOCK(sh)
+#define SHARD_UNLOCK(sh)
+#endif
 
 #define MEMCHECK_UTILITY        \
-    memcheck_source_t *souc = (memcheck_source_t*) malloc(sizeof(memcheck_source_t)); \
-    souc->filename = filename;  \
-    souc->lineno = lineno;      \
-    souc->funcname = funcname;  
+    memcheck_source_t souc;     \
+    souc.site = NULL;           \
+    souc.charged = 0;
+
+static memcheck_shard_t*
+_memcheck_shard_of(const void *ptr)
+{
+    /* heap pointers are 16-byte aligned, so drop the low bits before mixing */
+    uint64_t h = ((uint64_t)(uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull;
+    return &shards[ (h >> 40) & (MEMCHECK_SHARDS - 1) ];
+}
+
+static unsigned*
+_memcheck_filter_of(const void *ptr)
+{
+    uint64_t h = ((uint64_t)(uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull;
+    return &sample_filter[ (h >> 16) & (SAMPLE_FILTER_SIZE - 1) ];
+}
+
+/* exponentially distributed with mean sample_rate, so sampling is a poisson process over bytes */
+static long
+_memcheck_next_sample()
+{
+    if ( !sample_rng ) sample_rng = ((uint64_t)(uintptr_t)&sample_rng ^ (uint64_t)time(NULL)) | 1;
+    /* xorshift64* */
+    sample_rng ^= sample_rng >> 12;
+    sample_rng ^= sample_rng << 25;
+    sample_rng ^= sample_rng >> 27;
+    double u = ((sample_rng * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
+    return (long)(-log(1.0 - u) * sample_rate) + 1;
+}
+
+/* lock free, decides whether this allocation is recorded at all */
+static int
+_memcheck_should_sample(size_t sz)
+{
+    if ( !sample_rate ) return 1;
+    if ( !sample_countdown_init ){
+        bytes_until_sample = _memcheck_next_sample();
+        sample_countdown_init = 1;
+    }
+    bytes_until_sample -= (long)sz;
+    if ( bytes_until_sample > 0 ) return 0;
+    bytes_until_sample = _memcheck_next_sample();
+    return 1;
+}
+
+/* bytes a sampled allocation of sz stands for: sz / P(sampled) */
+static size_t
+_memcheck_sample_weight(size_t sz)
+{
+    if ( !sample_rate ) return sz;
+    if ( !sz ) sz = 1;
+    return (size_t)(sz / -expm1(-(double)sz / sample_rate) + 0.5);
+}
+
+/* blocks a record stands for, consistent between charge and uncharge */
+static size_t
+_memcheck_charged_blocks(memcheck_source_t *souc)
+{
+    if ( !sample_rate ) return 1;
+    size_t sz = souc->size ? souc->size : 1;
+    return (souc->charged + sz / 2) / sz;
+}
+
+static size_t
+_memcheck_site_hash(const char *filename, size_t lineno)
+{
+    /* string literals of one translation unit share the pointer */
+    return (size_t)(((uintptr_t)filename >> 3) ^ lineno * 0x9E3779B1u);
+}
+
+static int
+_memcheck_site_is(memcheck_site_t *site, const char *filename, size_t lineno, const char *funcname)
+{
+    if ( site->lineno != lineno ) return 0;
+    if ( site->filename == filename && site->funcname == funcname ) return 1;
+    /* same header line inlined into several translation units */
+    return strcmp(site->filename, filename) == 0 && strcmp(site->funcname, funcname) == 0;
+}
+
+/* slow path, sites are keyed by content so every literal copy maps to one site */
+static memcheck_site_t*
+_memcheck_site_intern(const char *filename, size_t lineno, const char *funcname)
+{
+    size_t h = lineno;
+    for ( const char *c = filename; *c; c++ ) h = 31 * h + (unsigned char)*c;
+    memcheck_site_t **bucket = &site_registry[ h % SITE_REGISTRY_SIZE ];
+
+    if ( pthread_mutex_lock(&site_lock) < 0 ) FATALERROR;
+    memcheck_site_t *site;
+    for ( site = *bucket; site; site = site->next ){
+        if ( _memcheck_site_is(site, filename, lineno, funcname) ) break;
+    }
+    if ( !site ){
+        site = (memcheck_site_t*) calloc(1, sizeof(memcheck_site_t));
+        if ( !site ) FATALERROR;
+        site->filename = filename;
+        site->lineno = lineno;
+        site->funcname = funcname;
+        site->next = *bucket;
+        *bucket = site;
+        site_count++;
+    }
+    if ( pthread_mutex_unlock(&site_lock) < 0 ) FATALERROR;
+    return site;
+}
+
+/* called with the shard locked */
+static memcheck_site_t*
+_memcheck_site_of(memcheck_shard_t *sh, const char *filename, size_t lineno, const char *funcname)
+{
+    memcheck_site_t **slot = &sh->site_cache[ _memcheck_site_hash(filename, lineno) % SITE_CACHE_SIZE ];
+    if ( !*slot || !_memcheck_site_is(*slot, filename, lineno, funcname) ){
+        *slot = _memcheck_site_intern(filename, lineno, funcname);
+    }
+    return *slot;
+}
+
+/* called with the shard locked */
+static void
+_memcheck_charge(memcheck_shard_t *sh, memcheck_source_t *souc)
+{
+    memcheck_site_t *site = souc->site;
+    souc->charged = _memcheck_sample_weight(souc->size);
+    size_t blocks = _memcheck_charged_blocks(souc);
+    __atomic_add_fetch(&sh->live_bytes, souc->charged, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->alloc_count, blocks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->alloc_bytes, souc->charged, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->live_count, blocks, __ATOMIC_RELAXED);
+    size_t live = __atomic_add_fetch(&site->live_bytes, souc->charged, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&site->peak_bytes, __ATOMIC_RELAXED);
+    while ( live > peak && !__atomic_compare_exchange_n(&site->peak_bytes, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+        ;
+}
+
+/* called with the shard locked */
+static void
+_memcheck_uncharge(memcheck_shard_t *sh, memcheck_source_t *souc)
+{
+    if ( !souc->charged ) return;
+    __atomic_sub_fetch(&sh->live_bytes, souc->charged, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&souc->site->live_count, _memcheck_charged_blocks(souc), __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&souc->site->live_bytes, souc->charged, __ATOMIC_RELAXED);
+}
 
 void
 memcheck_init()
 {
     if ( isinit ) return;
-    mem_dict = createHashTable(init_size);
-    isinit = 1;
+    memset(sample_filter, 0, sizeof(sample_filter));
+    for ( size_t i = 0; i < MEMCHECK_SHARDS; i++ ){
+        shards[i].mem_dict = createHashTable(init_size);
 #ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_init(&big_lock, NULL) < 0 ) FATALERROR;
-#endif 
+        if ( pthread_mutex_init(&shards[i].lock, NULL) < 0 ) FATALERROR;
+#endif
+    }
+    isinit = 1;
 }
 
 void
 memcheck_finalize()
 {
+    if ( !isinit ) return;
+    memcheck_profile_stop();
+    for ( size_t i = 0; i < MEMCHECK_SHARDS; i++ ){
+        SHARD_LOCK(&shards[i]);
+        destroyHashTable(shards[i].mem_dict);
+        memset(shards[i].site_cache, 0, sizeof(shards[i].site_cache));
+        shards[i].live_bytes = 0;
+        SHARD_UNLOCK(&shards[i]);
 #ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_lock(&big_lock) < 0 ) FATALERROR;
+        if ( pthread_mutex_destroy(&shards[i].lock) < 0 ) FATALERROR;
 #endif
-    if ( !isinit ) return;
-    HashTableIter *iter = getHashTableIter(mem_dict);
-    while ( hasNextElement(iter) ){
-        TableEntry *e = nextElement(iter);
-        free(e->value);
     }
-    destroyHashTableIter(iter);
-    destroyHashTable(mem_dict);
+    for ( size_t i = 0; i < SITE_REGISTRY_SIZE; i++ ){
+        memcheck_site_t *site = site_registry[i];
+        while ( site ){
+            memcheck_site_t *next = site->next;
+            free(site);
+            site = next;
+        }
+        site_registry[i] = NULL;
+    }
+    site_count = 0;
+    peak_total = 0;
     isinit = 0;
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_unlock(&big_lock) < 0 ) FATALERROR;
-    if ( pthread_mutex_destroy(&big_lock) < 0 ) FATALERROR;
-#endif
 }
 
 static void
@@ -57,21 +268,51 @@ _memcheck_abnormal_detected(const char *msg,...)
     va_end(va);
 }
 
+static void
+_memcheck_record(void *ptr, memcheck_source_t *souc, const char *filename, size_t lineno, const char *funcname)
+{
+    memcheck_shard_t *sh = _memcheck_shard_of(ptr);
+    SHARD_LOCK(sh);
+    souc->site = _memcheck_site_of(sh, filename, lineno, funcname);
+    if ( __atomic_load_n(&profiling, __ATOMIC_RELAXED) ) _memcheck_charge(sh, souc);
+    putKeyValue(sh->mem_dict, ptr, *souc);
+    if ( sample_rate ) __atomic_add_fetch(_memcheck_filter_of(ptr), 1, __ATOMIC_RELAXED);
+    SHARD_UNLOCK(sh);
+}
+
+static void
+_memcheck_forget(void *ptr, const char *what, const char *filename, size_t lineno, const char *funcname)
+{
+    /* unsampled allocations are unknown, only bother if the address may have been sampled */
+    unsigned *filter = _memcheck_filter_of(ptr);
+    if ( sample_rate && !__atomic_load_n(filter, __ATOMIC_RELAXED) ) return;
+
+    memcheck_shard_t *sh = _memcheck_shard_of(ptr);
+    SHARD_LOCK(sh);
+    memcheck_source_t *old = findValueByKey(sh->mem_dict, ptr);
+    if ( !old && sample_rate ){
+        SHARD_UNLOCK(sh);
+        return;
+    }
+    if ( !old ){
+        _memcheck_abnormal_detected("memcheck:%s:%lu:%s: attempt to %s not-malloced addr: %p\n",
+                filename, lineno, funcname, what, ptr);
+    }
+    _memcheck_uncharge(sh, old);
+    removeKey(sh->mem_dict, ptr);
+    if ( sample_rate ) __atomic_sub_fetch(filter, 1, __ATOMIC_RELAXED);
+    SHARD_UNLOCK(sh);
+}
+
 void*
 memcheck_malloc_do(size_t sz, const char *filename, size_t lineno, const char *funcname)
 {
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_lock(&big_lock) < 0 ) FATALERROR;
-#endif
     MEMCHECK_UTILITY;
-    souc->size = sz;
+    souc.size = sz;
 
     void *res = malloc(sz);
     if ( !res ) FATALERROR;
-    putKeyValue(mem_dict, res, souc);
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_unlock(&big_lock) < 0 ) FATALERROR;
-#endif
+    if ( _memcheck_should_sample(sz) ) _memcheck_record(res, &souc, filename, lineno, funcname);
     return res;
 }
 
@@ -79,91 +320,202 @@ memcheck_malloc_do(size_t sz, const char *filename, size_t lineno, const char *f
 void*
 memcheck_calloc_do(size_t cnt, size_t sz, const char *filename, size_t lineno, const char *funcname)
 {
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_lock(&big_lock) < 0 ) FATALERROR;
-#endif
     MEMCHECK_UTILITY;
-    souc->size = cnt * sz;
+    souc.size = cnt * sz;
 
     void *res = calloc(cnt, sz);
     if ( !res ) FATALERROR;
-    putKeyValue(mem_dict, res, souc);
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_unlock(&big_lock) < 0 ) FATALERROR;
-#endif
+    if ( _memcheck_should_sample(cnt * sz) ) _memcheck_record(res, &souc, filename, lineno, funcname);
     return res;
 }
 
 void*
 memcheck_realloc_do(void *ptr, size_t sz, const char *filename, size_t lineno, const char *funcname)
 {
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_lock(&big_lock) < 0 ) FATALERROR;
-#endif
     MEMCHECK_UTILITY;
-    souc->size = sz;
+    souc.size = sz;
 
     /* if ptr == NULL, realloc is just malloc */
+    /* old and new address may live in different shards */
     if( ptr ) {
-        memcheck_source_t *old = findValueByKey(mem_dict, ptr);
-        if ( !old ){
-            _memcheck_abnormal_detected("memcheck:%s:%lu:%s: attempt to realloc not-malloced addr: %p\n", 
-                    filename, lineno, funcname, ptr);
-        }
-        free(old);
-        removeKey(mem_dict, ptr);
+        _memcheck_forget(ptr, "realloc", filename, lineno, funcname);
     }
 
     void *res = realloc(ptr, sz);
     if ( !res ) FATALERROR;
 
-    putKeyValue(mem_dict, res, souc);
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_unlock(&big_lock) < 0 ) FATALERROR;
-#endif
+    /* a fresh sampling decision, as if it was a new allocation */
+    if ( _memcheck_should_sample(sz) ) _memcheck_record(res, &souc, filename, lineno, funcname);
     return res;
 }
 
 void
 memcheck_free_do(void *ptr, const char *filename, size_t lineno, const char *funcname)
 {
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_lock(&big_lock) < 0 ) FATALERROR;
-#endif
     /* if ptr == NULL, free do nothing */
     if ( ptr ){
-        memcheck_source_t *old = findValueByKey(mem_dict, ptr);
-        if ( !old ){
-            _memcheck_abnormal_detected("memcheck:%s:%lu:%s: attempt to realloc not-malloced addr: %p\n", 
-                    filename, lineno, funcname, ptr);
-        }
-        free(old);
-        removeKey(mem_dict, ptr);
+        _memcheck_forget(ptr, "free", filename, lineno, funcname);
     }
 
     free(ptr);
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_unlock(&big_lock) < 0 ) FATALERROR;
-#endif
 }
 
 void
 memcheck_check_do()
 {
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_lock(&big_lock) < 0 ) FATALERROR;
-#endif
-    printf("--- not freed:\n");
+    /* hold every shard so that the report is one consistent snapshot */
+    for ( size_t i = 0; i < MEMCHECK_SHARDS; i++ ){
+        SHARD_LOCK(&shards[i]);
+    }
+    if ( sample_rate ){
+        printf("--- not freed (sampled, 1 per %lu bytes on average):\n", sample_rate);
+    }else{
+        printf("--- not freed:\n");
+    }
 
-    HashTableIter *iter = getHashTableIter(mem_dict);
-    while ( hasNextElement(iter) ){
-        TableEntry *e = nextElement(iter);
-        void *addr = e->key;
-        memcheck_source_t *souc = e->value;
-        printf("addr: %p, %lu bytes allocated at %s:%lu:%s\n", addr, souc->size, souc->filename, souc->lineno, souc->funcname);
+    for ( size_t i = 0; i < MEMCHECK_SHARDS; i++ ){
+        HashTableIter *iter = getHashTableIter(shards[i].mem_dict);
+        while ( hasNextElement(iter) ){
+            TableEntry *e = nextElement(iter);
+            void *addr = e->key;
+            memcheck_source_t *souc = &e->value;
+            printf("addr: %p, %lu bytes allocated at %s:%lu:%s\n", addr, souc->size,
+                    souc->site->filename, souc->site->lineno, souc->site->funcname);
+        }
+        destroyHashTableIter(iter);
     }
-    destroyHashTableIter(iter);
-#ifdef MEMCHECK_MULTITHREAD
-    if ( pthread_mutex_unlock(&big_lock) < 0 ) FATALERROR;
-#endif
+    for ( size_t i = MEMCHECK_SHARDS; i-- > 0; ){
+        SHARD_UNLOCK(&shards[i]);
+    }
+}
+
+/* heap profiling */
+
+void
+memcheck_set_sample_rate(size_t mean_bytes)
+{
+    sample_rate = mean_bytes;
+}
+
+void
+memcheck_profile_enable()
+{
+    __atomic_store_n(&profiling, 1, __ATOMIC_RELAXED);
+}
+
+void
+memcheck_profile_disable()
+{
+    __atomic_store_n(&profiling, 0, __ATOMIC_RELAXED);
+}
+
+static size_t
+_memcheck_live_total()
+{
+    size_t total = 0;
+    for ( size_t i = 0; i < MEMCHECK_SHARDS; i++ ){
+        total += __atomic_load_n(&shards[i].live_bytes, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+void
+memcheck_profile_sample()
+{
+    size_t total = _memcheck_live_total();
+    if ( pthread_mutex_lock(&site_lock) < 0 ) FATALERROR;
+    /* remember who was holding the memory at the new high */
+    if ( total > peak_total ){
+        peak_total = total;
+        for ( size_t i = 0; i < SITE_REGISTRY_SIZE; i++ ){
+            for ( memcheck_site_t *site = site_registry[i]; site; site = site->next ){
+                site->at_peak_bytes = __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    if ( pthread_mutex_unlock(&site_lock) < 0 ) FATALERROR;
+}
+
+static void*
+_memcheck_sampler_run(void *args)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ( __atomic_load_n(&sampler_running, __ATOMIC_ACQUIRE) ){
+        memcheck_profile_sample();
+        if ( sampler_out ){
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            fprintf(sampler_out, "memcheck: %ld ms live %lu bytes peak %lu bytes\n", ms,
+                    _memcheck_live_total(), peak_total);
+        }
+        usleep(sampler_interval_ms * 1000);
+    }
+    return NULL;
+}
+
+void
+memcheck_profile_start(unsigned interval_ms, FILE *out)
+{
+    if ( sampler_running ) return;
+    sampler_interval_ms = interval_ms ? interval_ms : 1;
+    sampler_out = out;
+    sampler_running = 1;
+    if ( pthread_create(&sampler, NULL, _memcheck_sampler_run, NULL) < 0 ) FATALERROR;
+}
+
+void
+memcheck_profile_stop()
+{
+    if ( !sampler_running ) return;
+    __atomic_store_n(&sampler_running, 0, __ATOMIC_RELEASE);
+    if ( pthread_join(sampler, NULL) < 0 ) FATALERROR;
+}
+
+static int
+_memcheck_site_cmp(const void *a, const void *b)
+{
+    const memcheck_site_t *sa = *(memcheck_site_t* const*)a, *sb = *(memcheck_site_t* const*)b;
+    if ( sa->live_bytes != sb->live_bytes ) return sa->live_bytes < sb->live_bytes ? 1 : -1;
+    if ( sa->peak_bytes != sb->peak_bytes ) return sa->peak_bytes < sb->peak_bytes ? 1 : -1;
+    return 0;
+}
+
+void
+memcheck_profile_report(FILE *out, size_t top)
+{
+    memcheck_profile_sample();
+    if ( pthread_mutex_lock(&site_lock) < 0 ) FATALERROR;
+
+    /* sort copies, counters keep moving underneath */
+    memcheck_site_t *snap = (memcheck_site_t*) malloc(sizeof(memcheck_site_t) * (site_count + 1));
+    memcheck_site_t **order = (memcheck_site_t**) malloc(sizeof(memcheck_site_t*) * (site_count + 1));
+    if ( !snap || !order ) FATALERROR;
+    size_t n = 0;
+    for ( size_t i = 0; i < SITE_REGISTRY_SIZE; i++ ){
+        for ( memcheck_site_t *site = site_registry[i]; site; site = site->next ){
+            snap[n] = *site;
+            snap[n].live_bytes = __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED);
+            snap[n].live_count = __atomic_load_n(&site->live_count, __ATOMIC_RELAXED);
+            snap[n].peak_bytes = __atomic_load_n(&site->peak_bytes, __ATOMIC_RELAXED);
+            if ( !snap[n].alloc_count ) continue;
+            order[n] = &snap[n];
+            n++;
+        }
+    }
+    size_t peak = peak_total;
+    if ( pthread_mutex_unlock(&site_lock) < 0 ) FATALERROR;
+
+    qsort(order, n, sizeof(memcheck_site_t*), _memcheck_site_cmp);
+    if ( top && top < n ) n = top;
+
+    fprintf(out, "--- heap profile: live %lu bytes, peak %lu bytes\n", _memcheck_live_total(), peak);
+    fprintf(out, "%12s %8s %12s %12s %10s  %s\n", "live", "blocks", "site peak", "at peak", "allocs", "site");
+    for ( size_t i = 0; i < n; i++ ){
+        memcheck_site_t *site = order[i];
+        fprintf(out, "%12lu %8lu %12lu %12lu %10lu  %s:%lu:%s\n", site->live_bytes, site->live_count,
+                site->peak_bytes, site->at_peak_bytes, site->alloc_count, site->filename, site->lineno, site->funcname);
+    }
+    free(order);
+    free(snap);
 }
@@ -18,6 +18,24 @@
 #define memcheck_check                  memcheck_check_do
 /* user functions end */
 
+/* one per distinct (file, line, func) allocation site */
+typedef struct memcheck_site_s {
+    const char      *filename;
+    size_t          lineno;
+    const char      *funcname;
+
+    /* profiling counters, only move while profiling is enabled */
+    size_t          live_bytes;
+    size_t          live_count;
+    size_t          alloc_bytes;
+    size_t          alloc_count;
+    size_t          peak_bytes;
+    /* live_bytes when the sampler saw the highest total */
+    size_t          at_peak_bytes;
+
+    struct memcheck_site_s *next;
+} memcheck_site_t;
+
 void memcheck_init();
 void memcheck_finalize();
 
@@ -32,4 +50,20 @@ void memcheck_free_do(void *ptr, const char *filename, size_t lineno, const char
 
 void memcheck_check_do();
 
+/* heap profiling */
+/* record one allocation per mean_bytes allocated on average (0: every allocation) */
+/* unsampled allocations never take a lock, and are not checked for bad frees or leaks */
+/* profile figures become unbiased estimates; call before the first allocation */
+void memcheck_set_sample_rate(size_t mean_bytes);
+/* allocations made while enabled are charged to their site until freed */
+void memcheck_profile_enable();
+void memcheck_profile_disable();
+/* take one snapshot of the total live bytes, tracking the peak */
+void memcheck_profile_sample();
+/* snapshot every interval_ms from a background thread, print each one to out if not NULL */
+void memcheck_profile_start(unsigned interval_ms, FILE *out);
+void memcheck_profile_stop();
+/* sites sorted by live bytes, at most top of them (0 for all) */
+void memcheck_profile_report(FILE *out, size_t top);
+
 #endif /* _MEMCHECK_H_ */
@@ -29,7 +29,53 @@ void test(){
 
 }
 
+void test_profile(){
+    memcheck_init();
+    memcheck_profile_enable();
+
+    void* small[100];
+    for ( int i = 0; i < 100; i++ ){
+        small[i] = memcheck_malloc(16);
+    }
+    void* big = memcheck_malloc(4096);
+    memcheck_profile_sample();
+    big = memcheck_realloc(big, 8192);
+
+    for ( int i = 0; i < 50; i++ ){
+        memcheck_free(small[i]);
+    }
+    /* big first with 8192 live, small has 50 blocks live out of a 1600 bytes peak */
+    memcheck_profile_report(stdout, 0);
+
+    for ( int i = 50; i < 100; i++ ){
+        memcheck_free(small[i]);
+    }
+    memcheck_free(big);
+    memcheck_finalize();
+}
+
+void test_sampling(){
+    memcheck_set_sample_rate(4096);
+    memcheck_init();
+    memcheck_profile_enable();
+
+    /* 640000 bytes, about 156 of the blocks get recorded */
+    void* ptrs[10000];
+    for ( int i = 0; i < 10000; i++ ){
+        ptrs[i] = memcheck_malloc(64);
+    }
+    memcheck_profile_report(stdout, 0);
+
+    for ( int i = 0; i < 10000; i++ ){
+        memcheck_free(ptrs[i]);
+    }
+    memcheck_finalize();
+    memcheck_set_sample_rate(0);
+}
+
 int main(){
+    test_profile();
+    test_sampling();
     for ( long i = 0; i < 100000000; i++ ) test();
     //test();
 }
@@ -1,8 +1,14 @@
 #include "threadpool.h"
 #include "memtools/memcheck.h"
 #include <pthread.h>
+#include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <errno.h>
 
 void routine(void *dumb){
     printf("hello: %lu\n", pthread_self());
@@ -35,7 +41,779 @@ void testbasic(){
     }
 
     threadpool_join(pool);
-    threadpool_destroy(pool);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+}
+
+/* counting allocator, every block must be returned once the pool is gone */
+static long alloc_live;
+
+static void *counting_malloc(void *ctx, size_t sz){ __sync_fetch_and_add(&alloc_live, 1); return malloc(sz); }
+static void *counting_realloc(void *ctx, void *ptr, size_t sz){ if ( !ptr ) __sync_fetch_and_add(&alloc_live, 1); return realloc(ptr, sz); }
+static void counting_free(void *ctx, void *ptr){ if ( ptr ) __sync_fetch_and_sub(&alloc_live, 1); free(ptr); }
+
+void test_allocator(){
+    threadpool_allocator_t al = { counting_malloc, counting_realloc, counting_free, NULL };
+    threadpool_config_t config = { &al };
+    threadpool_t *pool = threadpool_create_ex(4, &config);
+
+    future_t futs[100];
+    for ( long i = 0; i < 100; i++ ){
+        futs[i] = threadpool_gofuture(pool, futroutine, (void*)i);
+    }
+    for ( long i = 0; i < 100; i++ ){
+        assert( (long)threadpool_get(pool, futs[i]) == i + 1 );
+    }
+    threadpool_join(pool);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    assert( alloc_live == 0 );
+}
+
+void *slowroutine(void *dumb) { usleep(20000); return dumb; }
+
+struct getter_args_s {
+    threadpool_t    *pool;
+    future_t        fut;
+    int             started;
+    future_status_t status;
+};
+
+void *getter(void *args){
+    struct getter_args_s *ga = (struct getter_args_s*) args;
+    void *value;
+    __atomic_store_n(&ga->started, 1, __ATOMIC_RELEASE);
+    ga->status = threadpool_get_status(ga->pool, ga->fut, &value);
+    return NULL;
+}
+
+void test_shutdown_cancel(){
+    threadpool_t *pool = threadpool_create(2);
+    future_t futs[20];
+    for ( long i = 0; i < 20; i++ ){
+        futs[i] = threadpool_gofuture(pool, slowroutine, (void*)i);
+    }
+
+    /* the last one is still queued when the pool goes down */
+    pthread_t th;
+    struct getter_args_s ga = { pool, futs[19], 0, future_status_pending };
+    pthread_create(&th, NULL, getter, &ga);
+    while ( !__atomic_load_n(&ga.started, __ATOMIC_ACQUIRE) ) usleep(1000);
+    usleep(5000);
+
+    assert( threadpool_shutdown(pool, threadpool_shutdown_cancel, 1000) == 0 );
+    pthread_join(th, NULL);
+    assert( ga.status == future_status_cancelled );
+    printf("shutdown cancel: last future cancelled\n");
+}
+
+void *spinroutine(void *dumb){
+    while ( !threadpool_token_cancelled(threadpool_current_token()) ) usleep(1000);
+    return dumb;
+}
+
+void test_token(){
+    threadpool_t *pool = threadpool_create(1);
+    threadpool_token_t *token = threadpool_token_create(pool);
+    task_attr_t attr = { token };
+
+    /* occupies the only worker until the token is cancelled */
+    future_t running = threadpool_gofuture_attr(pool, spinroutine, (void*)1, &attr);
+    future_t futs[10];
+    for ( long i = 0; i < 10; i++ ){
+        futs[i] = threadpool_gofuture_attr(pool, futroutine, (void*)i, &attr);
+    }
+    future_t other = threadpool_gofuture(pool, futroutine, (void*)41);
+    usleep(5000);
+    threadpool_token_cancel(token);
+
+    void *value;
+    assert( threadpool_get_status(pool, running, &value) == future_status_ok && value == (void*)1 );
+    for ( long i = 0; i < 10; i++ ){
+        assert( threadpool_get_status(pool, futs[i], &value) == future_status_cancelled );
+    }
+    assert( threadpool_get(pool, other) == (void*)42 );
+    threadpool_token_release(token);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("token: queued futures cancelled\n");
+
+    /* the token outlives its pool, cancelling it then reaches nothing */
+    threadpool_allocator_t al = { counting_malloc, counting_realloc, counting_free, NULL };
+    threadpool_config_t config = { &al };
+    pool = threadpool_create_ex(1, &config);
+    token = threadpool_token_create(pool);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    threadpool_token_cancel(token);
+    assert( threadpool_token_cancelled(token) );
+    threadpool_token_release(token);
+    assert( alloc_live == 0 );
+    printf("token: cancelled after shutdown\n");
+}
+
+void test_group(){
+    threadpool_t *pool = threadpool_create(4);
+    threadpool_group_t *slow = threadpool_group_create(pool);
+    threadpool_group_t *fast = threadpool_group_create(pool);
+    task_attr_t slow_attr = { NULL, slow }, fast_attr = { NULL, fast };
+
+    for ( long i = 0; i < 2; i++ ){
+        threadpool_goroutine_attr(pool, (void (*)(void*))slowroutine, (void*)i, &slow_attr);
+    }
+    for ( long i = 0; i < 100; i++ ){
+        threadpool_goroutine_attr(pool, evil, (void*)i, &fast_attr);
+    }
+
+    /* does not wait for the other group */
+    threadpool_group_wait(fast);
+    assert( threadpool_group_pending(fast) == 0 );
+    assert( threadpool_group_pending(slow) > 0 );
+    threadpool_group_wait(slow);
+
+    threadpool_group_destroy(slow);
+    threadpool_group_destroy(fast);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("group: waits are independent\n");
+}
+
+static long order[60];
+static long order_pos;
+void record(void *tag){ order[ __sync_fetch_and_add(&order_pos, 1) ] = (long)tag; }
+
+void test_context(){
+    threadpool_t *pool = threadpool_create(1);
+    threadpool_context_t *heavy = threadpool_context_create(pool, 3);
+    threadpool_context_t *light = threadpool_context_create(pool, 1);
+    threadpool_token_t *token = threadpool_token_create(pool);
+    task_attr_t block_attr = { token }, heavy_attr = { NULL, NULL, heavy }, light_attr = { NULL, NULL, light };
+
+    /* both contexts fill up behind the only worker */
+    threadpool_goroutine_attr(pool, (void (*)(void*))spinroutine, NULL, &block_attr);
+    for ( long i = 0; i < 30; i++ ){
+        threadpool_goroutine_attr(pool, record, (void*)1, &light_attr);
+        threadpool_goroutine_attr(pool, record, (void*)3, &heavy_attr);
+    }
+    usleep(5000);
+    threadpool_token_cancel(token);
+
+    threadpool_context_join(heavy);
+    long heavy_first = 0;
+    for ( long i = 0; i < 20; i++ ) heavy_first += order[i] == 3;
+    assert( heavy_first >= 14 );
+    threadpool_context_join(light);
+
+    threadpool_context_stats_t st;
+    threadpool_context_stats(heavy, &st);
+    assert( st.submitted == 30 && st.completed == 30 && st.cancelled == 0 && st.pending == 0 );
+    threadpool_context_destroy(heavy);
+    threadpool_context_destroy(light);
+    threadpool_token_release(token);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("context: %ld of the first 20 from the weight 3 context\n", heavy_first);
+}
+
+static threadpool_t *fiber_pool;
+
+void *fiberparent(void *dumb){
+    /* the only worker would wait on a child queued behind it without fibers */
+    future_t child = threadpool_gofuture(fiber_pool, futroutine, dumb);
+    return (void*)((long)threadpool_get(fiber_pool, child) + 1);
+}
+
+void test_fiber(){
+    threadpool_config_t config = { NULL, 64 * 1024 };
+    fiber_pool = threadpool_create_ex(1, &config);
+    future_t futs[100];
+    for ( long i = 0; i < 100; i++ ){
+        futs[i] = threadpool_gofuture(fiber_pool, fiberparent, (void*)i);
+    }
+    for ( long i = 0; i < 100; i++ ){
+        assert( threadpool_get(fiber_pool, futs[i]) == (void*)(i + 2) );
+    }
+    threadpool_shutdown(fiber_pool, threadpool_shutdown_drain, -1);
+    printf("fiber: 100 blocking gets on a single worker\n");
+}
+
+void test_io(){
+    threadpool_io_backend_t backends[2] = { threadpool_io_auto, threadpool_io_threads };
+    for ( int b = 0; b < 2; b++ ){
+        threadpool_config_t config = { NULL, 0, backends[b] };
+        threadpool_t *pool = threadpool_create_ex(2, &config);
+        char path[] = "/tmp/threadpool_io_XXXXXX";
+        int fd = mkstemp(path);
+        assert( fd >= 0 );
+        unlink(path);
+
+        char out[64][16], in[64][16];
+        future_t futs[64];
+        for ( int i = 0; i < 64; i++ ){
+            snprintf(out[i], 16, "block %d", i);
+            futs[i] = threadpool_write(pool, fd, out[i], 16, i * 16);
+        }
+        for ( int i = 0; i < 64; i++ ){
+            assert( (intptr_t)threadpool_get(pool, futs[i]) == 16 );
+        }
+        assert( (intptr_t)threadpool_get(pool, threadpool_fsync(pool, fd)) == 0 );
+        for ( int i = 0; i < 64; i++ ){
+            futs[i] = threadpool_read(pool, fd, in[i], 16, i * 16);
+        }
+        for ( int i = 0; i < 64; i++ ){
+            assert( (intptr_t)threadpool_get(pool, futs[i]) == 16 && strcmp(in[i], out[i]) == 0 );
+        }
+        assert( (intptr_t)threadpool_get(pool, threadpool_read(pool, -1, in[0], 16, 0)) == -EBADF );
+
+        close(fd);
+        threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    }
+    printf("io: round trip through both backends\n");
+}
+
+void test_cset(){
+    threadpool_t *pool = threadpool_create(2);
+    threadpool_cset_t *cset = threadpool_cset_create(pool);
+    int ep = epoll_create1(0);
+    struct epoll_event ev = { EPOLLIN };
+    assert( epoll_ctl(ep, EPOLL_CTL_ADD, threadpool_cset_fd(cset), &ev) == 0 );
+
+    /* some resolve before they are added */
+    for ( long i = 0; i < 20; i++ ){
+        threadpool_cset_add(cset, threadpool_gofuture(pool, i % 2 ? slowroutine : futroutine, (void*)i));
+    }
+    long sum = 0;
+    size_t got = 0;
+    while ( got < 20 ){
+        /* io_uring task work left on this thread by test_io shows up as EINTR */
+        int r;
+        while ( (r = epoll_wait(ep, &ev, 1, 5000)) < 0 && errno == EINTR );
+        assert( r == 1 );
+        future_t ready[4];
+        size_t n = threadpool_cset_drain(cset, ready, 4);
+        for ( size_t i = 0; i < n; i++ ){
+            sum += (long)threadpool_get(pool, ready[i]);
+        }
+        got += n;
+    }
+    /* odd ones come back as is, even ones plus one */
+    assert( sum == 190 + 10 );
+    assert( epoll_wait(ep, &ev, 1, 0) == 0 );
+
+    close(ep);
+    threadpool_cset_destroy(cset);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("cset: 20 futures through epoll\n");
+}
+
+static long timer_fired[3];
+void tick(void *which){ __sync_fetch_and_add(&timer_fired[(long)which], 1); }
+
+void test_timer(){
+    threadpool_t *pool = threadpool_create(1);
+
+    /* far more pending timers than workers, none of them holds one */
+    for ( long i = 0; i < 1000; i++ ){
+        threadpool_timer_release(threadpool_schedule_after(pool, 10 + i % 50, tick, (void*)0));
+    }
+    threadpool_timer_t *every = threadpool_schedule_every(pool, 10, tick, (void*)1);
+    threadpool_timer_t *never = threadpool_schedule_after(pool, 30, tick, (void*)2);
+    threadpool_timer_cancel(never);
+    usleep(105000);
+    threadpool_timer_cancel(every);
+    long periodic = timer_fired[1];
+    usleep(20000);
+
+    assert( timer_fired[0] == 1000 );
+    /* a run dispatched before the cancel got through may still land */
+    assert( periodic >= 5 && periodic <= 11 && timer_fired[1] <= periodic + 1 );
+    assert( timer_fired[2] == 0 );
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("timer: 1000 one shots, %ld periodic runs\n", periodic);
+
+    /* the handle outlives its pool, cancelling it then reaches nothing */
+    threadpool_allocator_t al = { counting_malloc, counting_realloc, counting_free, NULL };
+    threadpool_config_t config = { &al };
+    pool = threadpool_create_ex(1, &config);
+    threadpool_timer_t *late = threadpool_schedule_every(pool, 1000, tick, (void*)2);
+    threadpool_timer_t *kept = threadpool_schedule_after(pool, 1000, tick, (void*)2);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    threadpool_timer_cancel(late);
+    threadpool_timer_release(kept);
+    assert( timer_fired[2] == 0 );
+    assert( alloc_live == 0 );
+    printf("timer: cancelled after shutdown\n");
+}
+
+static char then_order[16];
+static size_t then_cnt;
+void mark(void *c){ then_order[ __atomic_fetch_add(&then_cnt, 1, __ATOMIC_ACQ_REL) ] = (char)(long)c; }
+
+typedef struct {
+    threadpool_t *pool;
+    future_t     fut;
+} late_then_t;
+
+/* registers its continuation only once the pool is dying */
+void latethen(void *args){
+    late_then_t *lt = (late_then_t*) args;
+    while ( __atomic_load_n(&lt->pool->state, __ATOMIC_ACQUIRE) != threadpool_state_about_to_die ) usleep(1000);
+    threadpool_future_then(lt->pool, lt->fut, mark, (void*)'c');
+}
+
+void test_then(){
+    threadpool_t *pool = threadpool_create(1);
+    late_then_t lt = { pool, threadpool_gofuture(pool, futroutine, NULL) };
+    /* resolved well before the continuation is added */
+    usleep(10000);
+    threadpool_goroutine(pool, latethen, &lt);
+    for ( int i = 0; i < 5; i++ ) threadpool_goroutine(pool, mark, (void*)'q');
+    threadpool_shutdown(pool, threadpool_shutdown_cancel, -1);
+    /* queued ones may be cancelled, the continuation is not */
+    assert( memchr(then_order, 'c', then_cnt) != NULL );
+    printf("then: a continuation runs on a dying pool\n");
+}
+
+typedef struct span_s {
+    long    from, to, step;
+    long    *out;
+} span_t;
+
+void sumspan(void *args){
+    span_t *sp = (span_t*) args;
+    long s = 0;
+    for ( long i = sp->from; i < sp->to; i += sp->step ) s += i;
+    __atomic_add_fetch(sp->out, s, __ATOMIC_RELAXED);
+}
+
+void *spanlen(void *args){
+    span_t *sp = (span_t*) args;
+    return (void*)((sp->to - sp->from) / sp->step);
+}
+
+void test_inline(){
+    threadpool_t *pool = threadpool_create(2);
+    long total = 0;
+    span_t sp = { 0, 0, 1, &total };
+    future_t futs[100];
+    for ( long i = 0; i < 100; i++ ){
+        /* the blob is copied, sp is free to change right away */
+        sp.from = i * 10;
+        sp.to = i * 10 + 10;
+        threadpool_goroutine_inline(pool, sumspan, &sp, sizeof(sp), NULL);
+        futs[i] = threadpool_gofuture_inline(pool, spanlen, &sp, sizeof(sp), NULL);
+    }
+    memset(&sp, 0, sizeof(sp));
+    for ( long i = 0; i < 100; i++ ) assert( (long)threadpool_get(pool, futs[i]) == 10 );
+    threadpool_join(pool);
+    assert( total == 999 * 1000 / 2 );
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("inline: 100 span tasks, no argument allocated\n");
+}
+
+typedef struct stats_s {
+    long    min, max, sum;
+} stats_t;
+
+void spanstats(void *args, void *res){
+    long n = (long) args;
+    stats_t *st = (stats_t*) res;
+    st->min = n;
+    st->max = 2 * n;
+    st->sum = n * 3;
+}
+
+void spanfill(void *args, void *res){
+    long *buf = (long*) res;
+    for ( long i = 0; i < 32; i++ ) buf[i] = (long)args + i;
+}
+
+void test_into(){
+    threadpool_t *pool = threadpool_create(2);
+    future_t futs[100];
+    /* results in the future slots */
+    for ( long i = 0; i < 100; i++ ){
+        futs[i] = threadpool_gofuture_into(pool, spanstats, (void*)i, NULL, sizeof(stats_t), NULL);
+    }
+    for ( long i = 0; i < 100; i++ ){
+        stats_t st;
+        assert( threadpool_get_into(pool, futs[i], &st, sizeof(st)) == future_status_ok );
+        assert( st.min == i && st.max == 2 * i && st.sum == 3 * i );
+    }
+    /* bigger than a slot, into the caller's buffer */
+    long bufs[4][32];
+    for ( long i = 0; i < 4; i++ ){
+        futs[i] = threadpool_gofuture_into(pool, spanfill, (void*)(i * 100), bufs[i], sizeof(bufs[i]), NULL);
+    }
+    for ( long i = 0; i < 4; i++ ){
+        assert( threadpool_get_into(pool, futs[i], NULL, 0) == future_status_ok );
+        assert( bufs[i][0] == i * 100 && bufs[i][31] == i * 100 + 31 );
+    }
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("into: 100 slot results, 4 caller buffers\n");
+}
+
+void *failodd(void *args){
+    long i = (long) args;
+    if ( i % 2 ) threadpool_fail(ENOENT);
+    return args;
+}
+
+void test_error(){
+    /* plain workers, then fibers */
+    threadpool_config_t configs[2] = { { NULL, 0 }, { NULL, 64 * 1024 } };
+    for ( int c = 0; c < 2; c++ ){
+        threadpool_t *pool = threadpool_create_ex(2, &configs[c]);
+        future_t futs[50];
+        for ( long i = 0; i < 50; i++ ) futs[i] = threadpool_gofuture(pool, failodd, (void*)i);
+        for ( long i = 0; i < 50; i++ ){
+            void *value;
+            future_status_t status = threadpool_get_status(pool, futs[i], &value);
+            if ( i % 2 ) assert( status == future_status_error && (intptr_t)value == ENOENT );
+            else assert( status == future_status_ok && value == (void*)i );
+        }
+        threadpool_fail(EINVAL);
+        assert( threadpool_get(pool, threadpool_gofuture(pool, failodd, (void*)1)) == NULL );
+        threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    }
+    printf("error: failed futures carry their code\n");
+}
+
+void burn(void *dumb){
+    /* about 2 ms of cpu */
+    struct timespec ts, now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    do {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    } while ( (now.tv_sec - ts.tv_sec) * 1000000000 + now.tv_nsec - ts.tv_nsec < 2000000 );
+}
+
+void nap(void *dumb){
+    usleep(2000);
+}
+
+void test_tags(){
+    threadpool_t *pool = threadpool_create(1);
+    task_attr_t busy = { NULL, NULL, NULL, 3 }, idle = { NULL, NULL, NULL, 5 };
+    for ( int i = 0; i < 10; i++ ){
+        threadpool_goroutine_attr(pool, burn, NULL, &busy);
+        threadpool_goroutine_attr(pool, nap, NULL, &idle);
+    }
+    threadpool_join(pool);
+
+    threadpool_tag_stats_t b, n, z;
+    threadpool_tag_stats(pool, 3, &b);
+    threadpool_tag_stats(pool, 5, &n);
+    threadpool_tag_stats(pool, 0, &z);
+    assert( b.tasks == 10 && n.tasks == 10 && z.tasks == 0 );
+    assert( b.cpu_ns >= 20000000 && n.cpu_ns < b.cpu_ns / 4 );
+    assert( n.wall_ns >= 20000000 );
+    /* one worker, whatever was queued waited for the rest */
+    assert( b.wait_ns + n.wait_ns > 0 );
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("tags: %lu us cpu busy, %lu us cpu idle\n", (unsigned long)(b.cpu_ns / 1000), (unsigned long)(n.cpu_ns / 1000));
+}
+
+static uint64_t _now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long limited_now, limited_max;
+
+void limited(void *dumb){
+    long n = __atomic_add_fetch(&limited_now, 1, __ATOMIC_ACQ_REL);
+    long m = __atomic_load_n(&limited_max, __ATOMIC_ACQUIRE);
+    while ( n > m && !__atomic_compare_exchange_n(&limited_max, &m, n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) );
+    usleep(5000);
+    __atomic_sub_fetch(&limited_now, 1, __ATOMIC_ACQ_REL);
+}
+
+void test_tag_limit(){
+    threadpool_t *pool = threadpool_create(4);
+    threadpool_group_t *noisy = threadpool_group_create(pool), *quiet = threadpool_group_create(pool);
+    threadpool_tag_limits_t one = { 1 };
+    threadpool_tag_limit(pool, 1, &one);
+    task_attr_t noisy_attr = { NULL, noisy, NULL, 1 }, quiet_attr = { NULL, quiet, NULL, 2 };
+    for ( int i = 0; i < 8; i++ ) threadpool_goroutine_attr(pool, limited, NULL, &noisy_attr);
+    for ( int i = 0; i < 8; i++ ) threadpool_goroutine_attr(pool, (void (*)(void*))futroutine, NULL, &quiet_attr);
+    /* not stuck behind the noisy ones */
+    threadpool_group_wait(quiet);
+    assert( threadpool_group_pending(noisy) > 1 );
+    threadpool_group_wait(noisy);
+    assert( limited_max == 1 );
+
+    /* 200 per second, no burst */
+    threadpool_tag_limits_t rate = { 0, 200, 1 };
+    threadpool_tag_limit(pool, 3, &rate);
+    task_attr_t rated_attr = { NULL, quiet, NULL, 3 };
+    uint64_t start = _now_ms();
+    for ( int i = 0; i < 11; i++ ) threadpool_goroutine_attr(pool, (void (*)(void*))futroutine, NULL, &rated_attr);
+    threadpool_group_wait(quiet);
+    uint64_t took = _now_ms() - start;
+    assert( took >= 45 );
+
+    threadpool_group_destroy(noisy);
+    threadpool_group_destroy(quiet);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("tag limit: 1 noisy at a time, 11 rated tasks in %lu ms\n", (unsigned long)took);
+}
+
+static threadpool_t *trace_pool;
+static long trace_order[40], trace_cnt;
+
+void traced(void *args){
+    long i = (long) args;
+    trace_order[ trace_cnt++ ] = i;
+    if ( i < 10 ) threadpool_goroutine(trace_pool, traced, (void*)(i + 100));
+}
+
+/* one worker, so the order the tasks ran in is the dispatch order */
+void trace_run(threadpool_trace_mode_t mode, threadpool_trace_t *trace, long *order){
+    threadpool_config_t config = { NULL, 0, threadpool_io_auto, mode, trace };
+    trace_pool = threadpool_create_ex(1, &config);
+    threadpool_group_t *g = threadpool_group_create(trace_pool);
+    task_attr_t attr = { NULL, g };
+    trace_cnt = 0;
+    for ( long i = 0; i < 20; i++ ) threadpool_goroutine_attr(trace_pool, traced, (void*)i, &attr);
+    threadpool_trace_start(trace_pool);
+    threadpool_group_wait(g);
+    threadpool_group_destroy(g);
+    threadpool_shutdown(trace_pool, threadpool_shutdown_drain, -1);
+    assert( trace_cnt == 30 );
+    memcpy(order, trace_order, sizeof(trace_order));
+}
+
+void test_trace(){
+    long first[40], again[40], replayed[40], other[40];
+    threadpool_trace_t *rec = threadpool_trace_create(NULL, 42);
+    threadpool_config_t wide = { NULL, 0, threadpool_io_auto, threadpool_trace_simulate, rec };
+    assert( threadpool_create_ex(2, &wide) == NULL );
+    trace_run(threadpool_trace_simulate, rec, first);
+    assert( rec->count == 30 );
+
+    FILE *f = tmpfile();
+    assert( threadpool_trace_save(rec, f) == 0 );
+    rewind(f);
+    threadpool_trace_t *loaded = threadpool_trace_load(NULL, f);
+    assert( loaded && loaded->count == 30 );
+    trace_run(threadpool_trace_replay, loaded, replayed);
+    assert( loaded->pos == 30 && !loaded->diverged );
+    assert( memcmp(first, replayed, sizeof(first)) == 0 );
+
+    /* as if recorded on four workers, replay goes its own way from there instead of waiting */
+    rewind(f);
+    threadpool_trace_t *wider = threadpool_trace_load(NULL, f);
+    fclose(f);
+    wider->entries[5].worker = 3;
+    trace_run(threadpool_trace_replay, wider, other);
+    assert( wider->pos == 5 && wider->diverged );
+    assert( memcmp(first, other, sizeof(long) * 5) == 0 );
+    threadpool_trace_destroy(wider);
+
+    threadpool_trace_t *same = threadpool_trace_create(NULL, 42), *seven = threadpool_trace_create(NULL, 7);
+    trace_run(threadpool_trace_simulate, same, again);
+    trace_run(threadpool_trace_simulate, seven, other);
+    assert( memcmp(first, again, sizeof(first)) == 0 );
+    assert( memcmp(first, other, sizeof(first)) != 0 );
+
+    threadpool_trace_destroy(rec);
+    threadpool_trace_destroy(loaded);
+    threadpool_trace_destroy(same);
+    threadpool_trace_destroy(seven);
+    printf("trace: seeded schedule replayed, %ld first\n", first[0]);
+}
+
+static threadpool_t *batch_pool;
+
+void *getprev(void *fut){
+    return threadpool_get(batch_pool, *(future_t*)fut);
+}
+
+void test_batch(){
+    threadpool_t *pool = threadpool_create(2);
+    threadpool_token_t *token = threadpool_token_create(pool);
+    task_attr_t attr = { token, NULL, NULL, 7 };
+    static future_t futs[20000];
+    /* far more queued than workers, handed out in batches */
+    for ( long i = 0; i < 20000; i++ ) futs[i] = threadpool_gofuture_attr(pool, futroutine, (void*)i, &attr);
+    threadpool_token_cancel(token);
+    long ok = 0, cancelled = 0;
+    for ( long i = 0; i < 20000; i++ ){
+        void *value;
+        future_status_t status = threadpool_get_status(pool, futs[i], &value);
+        if ( status == future_status_ok ){
+            assert( value == (void*)(i + 1) );
+            ok++;
+        }else{
+            assert( status == future_status_cancelled );
+            cancelled++;
+        }
+    }
+    threadpool_tag_stats_t st;
+    threadpool_tag_stats(pool, 7, &st);
+    assert( ok + cancelled == 20000 && st.tasks == (size_t) ok );
+    threadpool_token_release(token);
+
+    /* pairs queued up behind busy workers land in one batch, the second waits on the first */
+    batch_pool = pool;
+    threadpool_token_t *block = threadpool_token_create(pool);
+    task_attr_t blocked = { block };
+    future_t blockers[2], prev[20], next[20];
+    for ( int i = 0; i < 2; i++ ) blockers[i] = threadpool_gofuture_attr(pool, spinroutine, NULL, &blocked);
+    for ( long i = 0; i < 20; i++ ){
+        prev[i] = threadpool_gofuture(pool, futroutine, (void*)i);
+        next[i] = threadpool_gofuture(pool, getprev, &prev[i]);
+    }
+    threadpool_token_cancel(block);
+    for ( long i = 0; i < 20; i++ ) assert( threadpool_get(pool, next[i]) == (void*)(i + 1) );
+    for ( int i = 0; i < 2; i++ ) threadpool_get(pool, blockers[i]);
+    threadpool_token_release(block);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("batch: %ld ran, %ld cancelled\n", ok, cancelled);
+}
+
+static pthread_t ran_on[4][20];
+
+void *whereami(void *args){
+    long i = (long) args;
+    ran_on[i / 20][i % 20] = pthread_self();
+    return args;
+}
+
+void test_affinity(){
+    threadpool_t *pool = threadpool_create(4);
+    /* one at a time, the owner is always free */
+    for ( long i = 0; i < 20; i++ ){
+        for ( long key = 0; key < 4; key++ ){
+            threadpool_get(pool, threadpool_gofuture_keyed(pool, key * 1000, whereami, (void*)(key * 20 + i), NULL));
+        }
+    }
+    for ( long key = 0; key < 4; key++ ){
+        for ( long i = 1; i < 20; i++ ) assert( pthread_equal(ran_on[key][i], ran_on[key][0]) );
+    }
+
+    /* a burst on an idle owner stays with it, though the other workers are free */
+    pthread_t owner = ran_on[0][0];
+    future_t burst[WORKER_AFFINITY_STEAL];
+    for ( long i = 0; i < WORKER_AFFINITY_STEAL; i++ ) burst[i] = threadpool_gofuture_keyed(pool, 0, whereami, (void*)i, NULL);
+    for ( long i = 0; i < WORKER_AFFINITY_STEAL; i++ ){
+        threadpool_get(pool, burst[i]);
+        assert( pthread_equal(ran_on[0][i], owner) );
+    }
+
+    /* worker 0 is stuck, the others take over its queue */
+    threadpool_token_t *token = threadpool_token_create(pool);
+    task_attr_t attr = { token };
+    future_t stuck = threadpool_gofuture_on(pool, 0, spinroutine, NULL, &attr);
+    future_t futs[20];
+    for ( long i = 0; i < 20; i++ ) futs[i] = threadpool_gofuture_on(pool, 4, whereami, (void*)i, NULL);
+    for ( long i = 0; i < 20 - WORKER_AFFINITY_STEAL; i++ ) assert( threadpool_get(pool, futs[i]) == (void*)i );
+    threadpool_token_cancel(token);
+    for ( long i = 20 - WORKER_AFFINITY_STEAL; i < 20; i++ ) threadpool_get(pool, futs[i]);
+    threadpool_get(pool, stuck);
+    threadpool_token_release(token);
+
+    /* hints are no way around a tag's limits */
+    threadpool_tag_limits_t one = { 1 };
+    threadpool_tag_limit(pool, 5, &one);
+    threadpool_group_t *g = threadpool_group_create(pool);
+    task_attr_t capped = { NULL, g, NULL, 5 };
+    limited_max = 0;
+    for ( long key = 0; key < 8; key++ ) threadpool_goroutine_keyed(pool, key, limited, NULL, &capped);
+    threadpool_group_wait(g);
+    assert( limited_max == 1 );
+    threadpool_group_destroy(g);
+    threadpool_shutdown(pool, threadpool_shutdown_drain, -1);
+    printf("affinity: keys stay on their worker, a stuck one gets relieved\n");
+}
+
+typedef struct {
+    int inside;
+    long ran[200];
+    size_t cnt;
+} serial_t;
+
+static serial_t serials[8];
+
+void serialroutine(void *args){
+    long i = (long) args;
+    serial_t *s = &serials[i / 200];
+    /* no lock, the strand is the only guard */
+    assert( __atomic_exchange_n(&s->inside, 1, __ATOMIC_ACQ_REL) == 0 );
+    if ( i % 50 == 0 ) usleep(1000);
+    s->ran[ s->cnt++ ] = i % 200;
+    __atomic_store_n(&s->inside, 0, __ATOMIC_RELEASE);
+}
+
+static int handshake;
+
+void waitpeer(void *dumb){
+    while ( !__atomic_load_n(&handshake, __ATOMIC_ACQUIRE) ) usleep(1000);
+}
+
+void signalpeer(void *dumb){
+    __atomic_store_n(&handshake, 1, __ATOMIC_RELEASE);
+}
+
+void test_strand(){
+    threadpool_t *pool = threadpool_create(4);
+    threadpool_strand_t *strands[8];
+    for ( int k = 0; k < 8; k++ ) strands[k] = threadpool_strand_create(pool);
+    for ( long i = 0; i < 200; i++ ){
+        for ( long k = 0; k < 8; k++ ){
+            task_attr_t attr = { NULL, NULL, NULL, 0, strands[k] };
+            threadpool_goroutine_attr(pool, serialroutine, (void*)(k * 200 + i), &attr);
+        }
+    }
+    for ( int k = 0; k < 8; k++ ){
+        threadpool_strand_join(strands[k]);
+        assert( serials[k].cnt == 200 );
+        for ( long i = 0; i < 200; i++ ) assert( serials[k].ran[i] == i );
+    }
+
+    /* one strand waits on another, they have to run side by side */
+    task_attr_t a = { NULL, NULL, NULL, 0, strands[0] };
+    task_attr_t b = { NULL, NULL, NULL, 0, strands[1] };
+    threadpool_goroutine_attr(pool, waitpeer, NULL, &a);
+    threadpool_goroutine_attr(pool, signalpeer, NULL, &b);
+    threadpool_strand_join(strands[0]);
+
+    /* cancelled ones give their turn away, the rest still run in order */
+    threadpool_token_t *block = threadpool_token_create(pool);
+    threadpool_token_t *skip = threadpool_token_create(pool);
+    task_attr_t blocked = { block, NULL, NULL, 0, strands[2] };
+    task_attr_t skipped = { skip, NULL, NULL, 0, strands[2] };
+    task_attr_t plain = { NULL, NULL, NULL, 0, strands[2] };
+    serials[2].cnt = 0;
+    future_t head = threadpool_gofuture_attr(pool, spinroutine, NULL, &blocked);
+    future_t futs[10];
+    for ( long i = 0; i < 10; i++ ){
+        futs[i] = threadpool_gofuture_attr(pool, (void* (*)(void*)) serialroutine, (void*)(400 + i), i % 2 ? &skipped : &plain);
+    }
+    threadpool_token_cancel(skip);
+    threadpool_token_cancel(block);
+    threadpool_get(pool, head);
+    for ( long i = 0; i < 10; i++ ){
+        void *value;
+        future_status_t status = threadpool_get_status(pool, futs[i], &value);
+        assert( status == (i % 2 ? future_status_cancelled : future_status_ok) );
+    }
+    assert( serials[2].cnt == 5 );
+    for ( long i = 0; i < 5; i++ ) assert( serials[2].ran[i] == 2 * i );
+    threadpool_token_release(block);
+    threadpool_token_release(skip);
+
+    /* what still waits behind a running task is dropped by a cancelling shutdown */
+    threadpool_token_t *last = threadpool_token_create(pool);
+    task_attr_t stuck = { last, NULL, NULL, 0, strands[3] };
+    task_attr_t behind = { NULL, NULL, NULL, 0, strands[3] };
+    serials[3].cnt = 0;
+    threadpool_goroutine_attr(pool, (void (*)(void*)) spinroutine, NULL, &stuck);
+    for ( long i = 0; i < 10; i++ ) threadpool_goroutine_attr(pool, serialroutine, (void*)(600 + i), &behind);
+    /* times out on the spinning one, which is only let go once the manager knows */
+    assert( threadpool_shutdown(pool, threadpool_shutdown_cancel, 20) == ETIMEDOUT );
+    threadpool_token_cancel(last);
+    threadpool_strand_join(strands[3]);
+    assert( serials[3].cnt == 0 );
+    threadpool_token_release(last);
+    for ( int k = 0; k < 8; k++ ) threadpool_strand_destroy(strands[k]);
+    printf("strand: in order, one at a time, side by side\n");
 }
 
 void test_create_leak(){
@@ -49,10 +827,35 @@ void test_create_leak(){
 }
 
 int main(){
+    memcheck_init();
+    memcheck_profile_enable();
+    memcheck_profile_start(10, NULL);
     testbasic();
+    test_allocator();
+    test_shutdown_cancel();
+    test_token();
+    test_group();
+    test_context();
+    test_fiber();
+    test_io();
+    test_cset();
+    test_timer();
+    test_then();
+    test_inline();
+    test_into();
+    test_error();
+    test_tags();
+    test_tag_limit();
+    test_trace();
+    test_batch();
+    test_affinity();
+    test_strand();
 //    test_create_leak();    
-    sleep(5);
+    /* pools left tearing themselves down still hold their blocks */
+    threadpool_shutdown_wait_all();
     memcheck_check();
+    memcheck_profile_stop();
+    memcheck_profile_report(stdout, 10);
     printf("main thread about to terminate\n");
     _exit(0);
     printf("never print\n");
@@ -0,0 +1,146 @@
+#include "threadpool.hpp"
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+static std::atomic<long> news;
+
+void *operator new(std::size_t sz)
+{
+    news++;
+    if ( void *p = std::malloc(sz) ) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+static int add(int a, int b) { return a + b; }
+
+void test_typed(){
+    threadpool::Pool pool(4);
+
+    assert( pool.submit([]{ return 41; }).get() == 41 );
+    assert( pool.submit(add, 40, 2).get() == 42 );
+    assert( pool.submit([](std::string s){ return s + " world"; }, std::string("hello")).get() == "hello world" );
+
+    /* move only capture and argument */
+    auto p = std::make_unique<int>(7);
+    assert( pool.submit([p = std::move(p)]{ return *p; }).get() == 7 );
+    assert( pool.submit([](std::unique_ptr<int> q){ return *q + 1; }, std::make_unique<int>(7)).get() == 8 );
+
+    /* too big for a cell, goes to the heap instead */
+    std::array<char, 200> big{};
+    big[199] = 'x';
+    assert( pool.submit([big]{ return big; }).get()[199] == 'x' );
+
+    std::atomic<int> hits{0};
+    pool.submit([&hits]{ hits++; }).get();
+    assert( hits == 1 );
+    printf("cpp: typed results\n");
+}
+
+void test_no_alloc(){
+    threadpool::Pool pool(2);
+    std::vector<threadpool::Future<long>> futs;
+    futs.reserve(1000);
+    /* warm the cell free list up */
+    for ( long i = 0; i < 1000; i++ ) futs.push_back(pool.submit([i]{ return i; }));
+    for ( auto &f : futs ) f.get();
+    futs.clear();
+
+    long before = news;
+    long sum = 0;
+    for ( long i = 0; i < 1000; i++ ){
+        long a = i, b = 2 * i, c = 3 * i;
+        futs.push_back(pool.submit([a, b, c]{ return a + b + c; }));
+    }
+    for ( auto &f : futs ) sum += f.get();
+    assert( sum == 6 * 999 * 1000 / 2 );
+    assert( news == before );
+    printf("cpp: no allocation per task once warm\n");
+}
+
+void test_exception(){
+    threadpool::Pool pool(2);
+    auto f = pool.submit([]() -> int { throw std::out_of_range("deep"); });
+    try {
+        f.get();
+        assert( 0 );
+    } catch ( const std::out_of_range &e ) {
+        assert( std::string(e.what()) == "deep" );
+    }
+
+    /* a throwing callable is still destroyed */
+    auto p = std::make_shared<int>(1);
+    auto g = pool.submit([p]{ throw 7; });
+    try {
+        g.get();
+        assert( 0 );
+    } catch ( int e ) {
+        assert( e == 7 );
+    }
+    assert( p.use_count() == 1 );
+
+    auto h = pool.submit([]{ threadpool_fail(5); return std::string(100, 'x'); });
+    try {
+        h.get();
+        assert( 0 );
+    } catch ( const threadpool::task_error &e ) {
+        assert( e.code() == 5 );
+    }
+
+    /* never got, the destructor swallows it */
+    pool.submit([]{ throw 1; });
+    assert( pool.submit([]{ return 1; }).get() == 1 );
+    printf("cpp: exceptions cross to get\n");
+}
+
+/* fire and forget, enough to drive the awaitables */
+struct detached {
+    struct promise_type {
+        detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+static void *raw(void *dumb) { return (void*)((long)dumb + 1); }
+
+detached pipeline(threadpool::Pool &pool, long i, std::atomic<long> &sum, std::atomic<int> &done)
+{
+    co_await pool.schedule();
+    long doubled = co_await pool.submit([i]{ return 2 * i; });
+    void *plus = co_await pool.await_future(threadpool_gofuture(pool.get(), raw, (void*)doubled));
+    sum += (long)plus;
+    done++;
+}
+
+void test_coroutine(){
+    /* a blocking get on the only worker would never return */
+    threadpool::Pool pool(1);
+    std::atomic<long> sum{0};
+    std::atomic<int> done{0};
+    for ( long i = 0; i < 100; i++ ) pipeline(pool, i, sum, done);
+    while ( done < 100 ) usleep(1000);
+    assert( sum == 2 * 99 * 100 / 2 + 100 );
+    printf("cpp: 100 coroutines on one worker\n");
+}
+
+int main(){
+    test_typed();
+    test_no_alloc();
+    test_exception();
+    test_coroutine();
+    printf("main thread about to terminate\n");
+    _exit(0);
+}
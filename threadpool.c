@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "threadpool.h"
 #include "lock.h"
 #include "fatalerror.h"
@@ -7,25 +8,79 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 static void* _worker_run(void*);
 static void* _manager_run(void*);
+static void _task_init(struct threadpool_s*, task_t*, task_type_t, void* (*)(void*), void*, const task_attr_t*);
+
+/* token of the task running on this worker */
+static __thread threadpool_token_t *current_token;
+/* fiber running on this worker, fiber mode only */
+static __thread threadpool_fiber_t *current_fiber;
+/* task running on this worker outside a fiber */
+static __thread task_t *current_task;
+
+/* pools shut down and not yet torn down, process wide */
+static cond_lock_t shutdowns_lock;
+static size_t shutdowns;
+
+/* allocator utilities */
+
+/* keep the call site so that memcheck still attributes the default path */
+#define _pool_malloc(al, sz)        _allocator_malloc(al, sz, __FILE__, __LINE__, __func__)
+#define _pool_realloc(al, ptr, sz)  _allocator_realloc(al, ptr, sz, __FILE__, __LINE__, __func__)
+#define _pool_free(al, ptr)         _allocator_free(al, ptr, __FILE__, __LINE__, __func__)
+
+static void*
+_allocator_malloc(const threadpool_allocator_t *al, size_t sz, const char *filename, size_t lineno, const char *funcname)
+{
+    if ( !al->allocator_malloc ) return memcheck_malloc_do(sz, filename, lineno, funcname);
+    void *res = al->allocator_malloc(al->allocator_ctx, sz);
+    if ( !res ) FATALERROR;
+    return res;
+}
+
+static void*
+_allocator_realloc(const threadpool_allocator_t *al, void *ptr, size_t sz, const char *filename, size_t lineno, const char *funcname)
+{
+    if ( !al->allocator_realloc ) return memcheck_realloc_do(ptr, sz, filename, lineno, funcname);
+    void *res = al->allocator_realloc(al->allocator_ctx, ptr, sz);
+    if ( !res ) FATALERROR;
+    return res;
+}
+
+static void
+_allocator_free(const threadpool_allocator_t *al, void *ptr, const char *filename, size_t lineno, const char *funcname)
+{
+    if ( !al->allocator_free ) {
+        memcheck_free_do(ptr, filename, lineno, funcname);
+        return;
+    }
+    al->allocator_free(al->allocator_ctx, ptr);
+}
 
 /* future utilities */
 
 static future_list_t*
-_future_list_create(size_t sz)
+_future_list_create(const threadpool_allocator_t *al, size_t sz)
 {
-    future_list_t *fl = (future_list_t*) memcheck_malloc(sizeof(future_list_t));
+    future_list_t *fl = (future_list_t*) _pool_malloc(al, sizeof(future_list_t));
+    fl->allocator = al;
     fl->size = sz;
-    fl->entries = (future_list_entry_t*) memcheck_malloc(sizeof(future_list_entry_t) * sz);
+    fl->entries = (future_list_entry_t*) _pool_malloc(al, sizeof(future_list_entry_t) * sz);
     for ( size_t i = 0; i < sz; i++ ){
-        fl->entries[i].fut_access = (cond_lock_t*) memcheck_malloc(sizeof(cond_lock_t));
+        fl->entries[i].fut_access = (cond_lock_t*) _pool_malloc(al, sizeof(cond_lock_t));
         cond_lock_init(fl->entries[i].fut_access);
+        fl->entries[i].result_slot = _pool_malloc(al, FUTURE_RESULT_SIZE);
     }
     fl->list_pos = 0;
-    fl->available_stack = (index_t*) memcheck_malloc(sizeof(index_t) * sz);
+    fl->available_stack = (index_t*) _pool_malloc(al, sizeof(index_t) * sz);
     fl->available_stack_pos = 0;
     return fl;
 }
@@ -35,32 +90,43 @@ _future_list_destroy(future_list_t *futs)
 {
     for ( size_t i = 0; i < futs->size; i++ ){
         cond_lock_destroy(futs->entries[i].fut_access);
-        memcheck_free(futs->entries[i].fut_access);
+        _pool_free(futs->allocator, futs->entries[i].fut_access);
+        _pool_free(futs->allocator, futs->entries[i].result_slot);
     }
-    memcheck_free(futs->entries);
-    memcheck_free(futs->available_stack);
-    memcheck_free(futs);
+    _pool_free(futs->allocator, futs->entries);
+    _pool_free(futs->allocator, futs->available_stack);
+    _pool_free(futs->allocator, futs);
 }
 
 static index_t 
 _future_get_next(future_list_t *futs)
 {
     if ( futs->available_stack_pos > 0 ){
-        return futs->available_stack[ --futs->available_stack_pos ];
+        index_t ind = futs->available_stack[ --futs->available_stack_pos ];
+        futs->entries[ind].status = future_status_pending;
+        futs->entries[ind].waiter = NULL;
+        futs->entries[ind].cset = NULL;
+        futs->entries[ind].then_routine = NULL;
+        return ind;
     }
 
     /* entries list is full */
     if ( futs->list_pos == futs->size ){
         futs->size *= 2;
-        futs->entries = (future_list_entry_t*) memcheck_realloc(futs->entries, sizeof(future_list_entry_t) * futs->size);
-        futs->available_stack = (index_t*) memcheck_realloc(futs->available_stack, sizeof(index_t) * futs->size);
+        futs->entries = (future_list_entry_t*) _pool_realloc(futs->allocator, futs->entries, sizeof(future_list_entry_t) * futs->size);
+        futs->available_stack = (index_t*) _pool_realloc(futs->allocator, futs->available_stack, sizeof(index_t) * futs->size);
 
         for ( size_t i = futs->size / 2; i < futs->size; i++ ){
-            futs->entries[i].fut_access = (cond_lock_t*) memcheck_malloc(sizeof(cond_lock_t));
+            futs->entries[i].fut_access = (cond_lock_t*) _pool_malloc(futs->allocator, sizeof(cond_lock_t));
             cond_lock_init(futs->entries[i].fut_access);
+            futs->entries[i].result_slot = _pool_malloc(futs->allocator, FUTURE_RESULT_SIZE);
         }
     }
 
+    futs->entries[futs->list_pos].status = future_status_pending;
+    futs->entries[futs->list_pos].waiter = NULL;
+    futs->entries[futs->list_pos].cset = NULL;
+    futs->entries[futs->list_pos].then_routine = NULL;
     return futs->list_pos++;
 }
 
@@ -77,11 +143,12 @@ _future_put_available(future_list_t *futs, index_t ind)
 /* event utilities */
 
 static event_queue_t*
-_event_queue_create(size_t sz)
+_event_queue_create(const threadpool_allocator_t *al, size_t sz)
 {
-    event_queue_t *qu = (event_queue_t*) memcheck_malloc(sizeof(event_queue_t));
+    event_queue_t *qu = (event_queue_t*) _pool_malloc(al, sizeof(event_queue_t));
+    qu->allocator = al;
     qu->size = sz;
-    qu->events = (manager_event_t*) memcheck_malloc(sizeof(manager_event_t) * sz);
+    qu->events = (manager_event_t*) _pool_malloc(al, sizeof(manager_event_t) * sz);
     qu->head = 0;
     qu->tail = 0;
     return qu;
@@ -90,8 +157,8 @@ _event_queue_create(size_t sz)
 static void
 _event_queue_destroy(event_queue_t *qu)
 {
-    memcheck_free(qu->events);
-    memcheck_free(qu);
+    _pool_free(qu->allocator, qu->events);
+    _pool_free(qu->allocator, qu);
 }
 
 static void
@@ -102,7 +169,7 @@ _event_queue_push(event_queue_t *qu, manager_event_t *e)
 #ifdef DEBUG
         printf("doubling event_queue: old qu->size = %lu\n", qu->size);
 #endif
-        qu->events = (manager_event_t*) memcheck_realloc( qu->events, sizeof(manager_event_t) * qu->size * 2);
+        qu->events = (manager_event_t*) _pool_realloc(qu->allocator, qu->events, sizeof(manager_event_t) * qu->size * 2);
         if ( qu->head > qu->tail ){
             memcpy(qu->events + qu->size, qu->events, sizeof(manager_event_t) * qu->tail);
             qu->tail += qu->size;
@@ -129,11 +196,12 @@ _event_queue_pop(event_queue_t *qu)
 /* task utilities */
 
 static task_queue_t*
-_task_queue_create(size_t sz)
+_task_queue_create(const threadpool_allocator_t *al, size_t sz)
 {
-    task_queue_t *qu = (task_queue_t*) memcheck_malloc(sizeof(task_queue_t));
+    task_queue_t *qu = (task_queue_t*) _pool_malloc(al, sizeof(task_queue_t));
+    qu->allocator = al;
     qu->size = sz;
-    qu->tasks = (task_t*) memcheck_malloc(sizeof(task_t) * sz);
+    qu->tasks = (task_t*) _pool_malloc(al, sizeof(task_t) * sz);
     qu->head = 0;
     qu->tail = 0;
     return qu;
@@ -142,8 +210,8 @@ _task_queue_create(size_t sz)
 static void
 _task_queue_destroy(task_queue_t *qu)
 {
-    memcheck_free(qu->tasks);
-    memcheck_free(qu);
+    _pool_free(qu->allocator, qu->tasks);
+    _pool_free(qu->allocator, qu);
 }
 
 static int
@@ -160,7 +228,7 @@ _task_queue_push(task_queue_t *qu, task_t *t)
 #ifdef DEBUG
         printf("doubling task_queue: old qu->size = %lu\n", qu->size);
 #endif
-        qu->tasks = (task_t*) memcheck_realloc( qu->tasks, sizeof(task_t) * qu->size * 2);
+        qu->tasks = (task_t*) _pool_realloc(qu->allocator, qu->tasks, sizeof(task_t) * qu->size * 2);
         if ( qu->head > qu->tail ){
             memcpy(qu->tasks + qu->size, qu->tasks, sizeof(task_t) * qu->tail);
             qu->tail += qu->size;
@@ -184,283 +252,2208 @@ _task_queue_pop(task_queue_t *qu)
     return res;
 }
 
-/* threads communication */
+/* inline payloads move with every copy of the task, only the running copy is handed out */
+static void*
+_task_args(task_t *t)
+{
+    return t->task_inline_size ? t->task_inline : t->task_argu;
+}
+
+static uint64_t
+_clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
+/* by worker, around every stretch the task runs on it */
 static void
-_inform_manager(threadpool_t *pool, manager_event_t *e)
+_task_account_begin(task_t *t)
 {
-    cond_lock_er_lock(&pool->manager_inform);
-    _event_queue_push(pool->event_queue, e);
-    cond_lock_er_activate(&pool->manager_inform);
+    if ( !t->task_started_ns ) t->task_started_ns = _clock_ns(CLOCK_MONOTONIC);
+    /* last, nothing the worker does before the call is charged; unsigned, the end adds it back */
+    t->task_cpu_ns -= _clock_ns(CLOCK_THREAD_CPUTIME_ID);
 }
 
 static void
-_manager_assign_task(threadpool_t *pool)
+_task_account_end(task_t *t)
 {
-    while ( pool->pos > 0 ){
-        task_t *t = _task_queue_pop(pool->task_queue);
-        if ( t == NULL ) break;
+    t->task_cpu_ns += _clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
 
-        worker_t *wk = &pool->workers[ pool->worker_available_stack[--pool->pos] ];
-        wk->task = *t;
-        cond_lock_er_lock(&wk->worker_wakeup);
-        cond_lock_er_activate(&wk->worker_wakeup);
+/* by worker, once the task is finished */
+static void
+_task_account(threadpool_t *pool, task_t *t)
+{
+    threadpool_tag_stats_t *st = &pool->tags[ t->task_tag ];
+    __atomic_add_fetch(&st->tasks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->cpu_ns, t->task_cpu_ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->wall_ns, _clock_ns(CLOCK_MONOTONIC) - t->task_started_ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->wait_ns, t->task_started_ns - t->task_submitted_ns, __ATOMIC_RELAXED);
+}
+
+/* the value a gofuture resolves to */
+static void*
+_task_run(task_t *t)
+{
+    if ( t->task_into ){
+        t->task_into(_task_args(t), t->task_res);
+        return t->task_res;
     }
+    return t->task_func(_task_args(t));
 }
 
-static int
-_all_worker_available(threadpool_t *pool)
+/* removes the i-th queued task, keeping the order of the rest */
+static void
+_task_queue_take(task_queue_t *qu, size_t i, task_t *out)
 {
-    return pool->size == pool->pos;
+    index_t at = (qu->head + i) % qu->size;
+    *out = qu->tasks[at];
+    for ( index_t r = (at + 1) % qu->size; r != qu->tail; r = (r + 1) % qu->size ){
+        qu->tasks[at] = qu->tasks[r];
+        at = r;
+    }
+    qu->tail = at;
 }
 
-/* precondition: all worker available, no task*/
+/* compact in place, keeping order; removed tasks go to drop() */
 static void
-_do_destroy_all(threadpool_t *pool)
+_task_queue_remove_if(task_queue_t *qu, int (*pred)(task_t*, void*), void *arg,
+        void (*drop)(task_t*, void*), void *drop_arg)
 {
-    cond_lock_destroy(&pool->manager_inform);
-    cond_lock_destroy(&pool->join);
+    index_t w = qu->head;
+    for ( index_t r = qu->head; r != qu->tail; r = (r + 1) % qu->size ){
+        if ( pred(&qu->tasks[r], arg) ){
+            drop(&qu->tasks[r], drop_arg);
+            continue;
+        }
+        if ( w != r ) qu->tasks[w] = qu->tasks[r];
+        w = (w + 1) % qu->size;
+    }
+    qu->tail = w;
+}
 
-    _event_queue_destroy(pool->event_queue);
-    _task_queue_destroy(pool->task_queue);
-    _future_list_destroy(pool->future_list);
+/* context utilities */
 
-    for ( size_t i = 0; i < pool->size; i++ ){
-        worker_t *wk = &pool->workers[i];
-        wk->task.task_type = task_die;
-        cond_lock_er_lock(&wk->worker_wakeup);
-        cond_lock_er_activate(&wk->worker_wakeup);
-        if ( pthread_join(wk->worker, NULL) < 0 ) FATALERROR;
+/* pass advance of a weight 1 context per dispatched task */
+#define CONTEXT_STRIDE          (1u << 20)
 
-        cond_lock_destroy(&wk->worker_wakeup);
-    }
-    memcheck_free(pool->workers);
-    memcheck_free(pool->worker_available_stack);
-    memcheck_free(pool);
-    pthread_exit(NULL);
+static void
+_group_init(threadpool_group_t *g, const threadpool_allocator_t *al)
+{
+    g->allocator = *al;
+    g->pending = 0;
+    cond_lock_init(&g->idle);
 }
 
 static void
-_manager_handle_event_call_die(threadpool_t *pool)
+_group_add(threadpool_group_t *g)
 {
-    /* empty all tasks */
-    pool->state = threadpool_state_about_to_die;
+    __atomic_add_fetch(&g->pending, 1, __ATOMIC_RELAXED);
+}
 
-    if ( _all_worker_available(pool) ) {
-        assert( _task_queue_empty(pool->task_queue) );
-        _do_destroy_all(pool);
-    }
+static void
+_group_done(threadpool_group_t *g)
+{
+    /* under the lock, a waiter seeing 0 may destroy the group right away */
+    cond_lock_lock(&g->idle);
+    if ( __atomic_sub_fetch(&g->pending, 1, __ATOMIC_ACQ_REL) == 0 ) cond_lock_broadcast(&g->idle);
+    cond_lock_unlock(&g->idle);
+}
+
+static threadpool_context_t*
+_context_create(threadpool_t *pool, unsigned weight)
+{
+    threadpool_context_t *ctx = (threadpool_context_t*) _pool_malloc(&pool->allocator, sizeof(threadpool_context_t));
+    ctx->pool = pool;
+    ctx->task_queue = _task_queue_create(&pool->allocator, pool->size + 2);
+    ctx->weight = weight ? weight : 1;
+    ctx->pass = 0;
+    _group_init(&ctx->scope, &pool->allocator);
+    ctx->submitted = 0;
+    ctx->completed = 0;
+    ctx->cancelled = 0;
+    return ctx;
 }
 
 static void
-_manager_handle_event_task_addin(threadpool_t *pool, task_t *t)
+_context_destroy(threadpool_context_t *ctx)
 {
-    switch (pool->state) {
-        case threadpool_state_normal:
-            cond_lock_er_lock(&pool->join);
-            cond_lock_er_disactivate(&pool->join);
-            _task_queue_push(pool->task_queue, t);
-            _manager_assign_task(pool);
-            break;
-        case threadpool_state_about_to_die:
-            break;
-        default:
-            assert(0);
+    _task_queue_destroy(ctx->task_queue);
+    cond_lock_destroy(&ctx->scope.idle);
+    _pool_free(&ctx->pool->allocator, ctx);
+}
+
+static void
+_context_push(threadpool_t *pool, threadpool_context_t *ctx, task_t *t)
+{
+    /* no credit for the time it was idle */
+    if ( _task_queue_empty(ctx->task_queue) && ctx->pass < pool->vtime ) ctx->pass = pool->vtime;
+    _task_queue_push(ctx->task_queue, t);
+}
+
+/* weighted fair pick among the busy contexts */
+static task_t*
+_context_pop(threadpool_t *pool)
+{
+    threadpool_context_t *best = NULL;
+    for ( size_t i = 0; i < pool->contexts_cnt; i++ ){
+        threadpool_context_t *ctx = pool->contexts[i];
+        if ( _task_queue_empty(ctx->task_queue) ) continue;
+        if ( !best || ctx->pass < best->pass ) best = ctx;
+    }
+    if ( !best ) return NULL;
+    pool->vtime = best->pass;
+    best->pass += CONTEXT_STRIDE / best->weight;
+    return _task_queue_pop(best->task_queue);
+}
+
+static int
+_contexts_empty(threadpool_t *pool)
+{
+    for ( size_t i = 0; i < pool->contexts_cnt; i++ ){
+        if ( !_task_queue_empty(pool->contexts[i]->task_queue) ) return 0;
     }
+    return 1;
 }
 
+/* strand utilities */
+
+/* by manager, the task of st in flight is done with, whether it ran or not */
 static void
-_manager_handle_event_worker_done(threadpool_t *pool, index_t worker_ind)
+_strand_release(threadpool_t *pool, threadpool_strand_t *st)
 {
-    worker_t *wk = &pool->workers[worker_ind];
-    task_t *t = &wk->task;
-    if ( t->task_type == task_gofuture ) {
-        future_list_entry_t *fe = &pool->future_list->entries[t->task_fut];
-        fe->value = wk->worker_task_res;
-        cond_lock_er_activate(fe->fut_access);
+    if ( _task_queue_empty(st->waiting) ){
+        st->busy = 0;
+    }else{
+        /* queued later, the caller may be walking the very queue the next task goes to */
+        st->next_ready = NULL;
+        if ( pool->strands_ready ) pool->strands_ready_tail->next_ready = st;
+        else pool->strands_ready = st;
+        pool->strands_ready_tail = st;
     }
-    pool->worker_available_stack[ pool->pos++ ] = worker_ind;
+    /* last, a joiner seeing it idle may destroy the strand */
+    _group_done(&st->scope);
+}
 
-    if ( _all_worker_available(pool) && _task_queue_empty(pool->task_queue) ){
-        switch (pool->state){
-            case threadpool_state_about_to_die:
-                _do_destroy_all(pool);
-                return;
-            case threadpool_state_normal:
-                cond_lock_er_lock(&pool->join);
-                cond_lock_er_activate(&pool->join);
-                break;
-            default:
-                assert(0);
-        }
-    } 
-    _manager_assign_task(pool);
+/* timer utilities */
+
+static uint64_t
+_clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-struct worker_args_s {
-    threadpool_t    *pool;
-    index_t         this_ind;
-};
+/* by manager, at shutdown */
+static void
+_timer_drop(timer_node_t *node, void *args)
+{
+    threadpool_timer_t *timer = (threadpool_timer_t*) node;
+    timer->armed = 0;
+    threadpool_timer_release(timer);
+}
 
-static void*
-_manager_run(void *args)
+/* completion set utilities */
+
+/* manager_inform held, which orders it before the set's own lock */
+static void
+_cset_push(threadpool_cset_t *cset, future_t fut)
 {
-    threadpool_t *pool = (threadpool_t*) args;
-    for ( size_t i = 0; i < pool->size; i++ ){
-        struct worker_args_s *worker_args = (struct worker_args_s*) memcheck_malloc(sizeof(struct worker_args_s));
-        worker_args->pool = pool;
-        worker_args->this_ind = i;
-        if ( pthread_create(&pool->workers[i].worker, NULL, _worker_run, worker_args) < 0 ) FATALERROR;
+    cond_lock_lock(&cset->lock);
+    if ( cset->ready_cnt == cset->ready_size ){
+        cset->ready_size = cset->ready_size ? cset->ready_size * 2 : 16;
+        cset->ready = (future_t*) _pool_realloc(&cset->pool->allocator, cset->ready, sizeof(future_t) * cset->ready_size);
     }
+    cset->ready[ cset->ready_cnt++ ] = fut;
+    cond_lock_unlock(&cset->lock);
+
+    uint64_t one = 1;
+    /* EAGAIN only if the counter is about to overflow, it is readable then anyway */
+    if ( write(cset->efd, &one, sizeof(one)) < 0 && errno != EAGAIN ) FATALERROR;
+}
 
+/* fiber utilities */
+
+static void
+_fiber_entry(void)
+{
+    /* set by the worker before switching in the first time */
+    threadpool_fiber_t *f = current_fiber;
+    /* reused for task after task, no makecontext per task */
     for ( ; ; ){
-        cond_lock_ee_wait(&pool->manager_inform);
-        /* at least one inform to manager received */
-        manager_event_t *e;
-        while ( (e = _event_queue_pop(pool->event_queue)) != NULL ){
-            switch ( e->event_type ){
-                    break;
-                case manager_event_call_die:
-                    _manager_handle_event_call_die(pool);
-                    break;
-                case manager_event_task_addin:
-                    _manager_handle_event_task_addin(pool, &e->data.task);
-                    break;
-                case manager_event_worker_done:
-                    _manager_handle_event_worker_done(pool, e->data.worker_ind);
-                    break;
-                default:
-                    assert(0);
-            }
-        }
-        cond_lock_ee_finish(&pool->manager_inform);
+        f->res = _task_run(&f->task);
+        f->state = fiber_state_done;
+        fiber_switch(&f->fiber.ctx, &f->worker->sched);
     }
 }
 
-static void*
-_worker_run(void *args)
+/* by manager */
+static threadpool_fiber_t*
+_fiber_get(threadpool_t *pool)
 {
-    struct worker_args_s *real_args = (struct worker_args_s*) args;
-    threadpool_t *pool = real_args->pool;
-    index_t this_ind = real_args->this_ind;
-    memcheck_free(args);
-    worker_t *worker_self = &pool->workers[this_ind];
-
-    for ( ; ; ){
-        cond_lock_ee_wait(&worker_self->worker_wakeup);
-        /* a new task is received */
-        task_t *t = &worker_self->task;
-        switch ( t->task_type ){
-            case task_goroutine:
-                t->task_func(t->task_argu);
-                break;
-            case task_gofuture:
-                worker_self->worker_task_res = t->task_func(t->task_argu);
-                break;
-            case task_die:
-                pthread_exit(NULL);
-                break;
-            default:
-                assert(0);
-        }
-        manager_event_t e;
-        e.event_type = manager_event_worker_done;
-        e.data.worker_ind = this_ind;
-        _inform_manager(pool, &e);
-        cond_lock_ee_finish(&worker_self->worker_wakeup);
+    threadpool_fiber_t *f = pool->fibers_free;
+    if ( f ){
+        pool->fibers_free = f->next;
+        return f;
     }
-    return NULL;
+    f = (threadpool_fiber_t*) _pool_malloc(&pool->allocator, sizeof(threadpool_fiber_t));
+    fiber_init(&f->fiber, pool->fiber_stack_size, _fiber_entry);
+    f->pool = pool;
+    return f;
 }
 
-threadpool_t*
-threadpool_create(size_t sz)
+/* by manager */
+static void
+_fiber_put(threadpool_t *pool, threadpool_fiber_t *f)
 {
-    if ( !sz ) return NULL;
-    memcheck_init();
+    f->next = pool->fibers_free;
+    pool->fibers_free = f;
+}
 
-    threadpool_t *pool = (threadpool_t*) memcheck_malloc(sizeof(threadpool_t));
-    /* manager itself at last */
-    pool->state = threadpool_state_normal;
-    cond_lock_init(&pool->manager_inform);
-    cond_lock_init(&pool->join);
-    
-    pool->event_queue = _event_queue_create(sz + 2);
-    pool->task_queue = _task_queue_create(sz + 2);
-    pool->future_list = _future_list_create(sz);
-    
-    pool->size = sz;
-    pool->workers = (worker_t*) memcheck_malloc(sizeof(worker_t) * sz);
-    for ( size_t i = 0; i < sz; i++ ){
-        worker_t *wk = &pool->workers[i];
-        cond_lock_init(&wk->worker_wakeup);
-    }
-    pool->worker_available_stack = (index_t*) memcheck_malloc(sizeof(index_t) * sz);
-    for ( size_t i = 0; i < sz; i++ ){
-        pool->worker_available_stack[i] = sz - 1 - i;
+/* by manager, resumed fibers go before new tasks */
+static void
+_fiber_resume(threadpool_t *pool, threadpool_fiber_t *f)
+{
+    task_t t;
+    t.task_type = task_resume;
+    t.task_token = NULL;
+    t.task_fiber = f;
+    t.task_seq = f->task.task_seq;
+    _task_queue_push(pool->resume_queue, &t);
+    pool->fibers_suspended--;
+}
+
+/* by the fiber itself, returns on whichever worker resumes it */
+static void
+_fiber_suspend(threadpool_fiber_t *f, future_t fut)
+{
+    f->state = fiber_state_suspended;
+    f->wait_fut = fut;
+    fiber_switch(&f->fiber.ctx, &f->worker->sched);
+}
+
+/* threads communication */
+
+/* by manager, continuations go before new tasks like resumed fibers */
+static void
+_future_continue(threadpool_t *pool, void (*routine)(void*), void *args)
+{
+    task_t t;
+    _task_init(pool, &t, task_goroutine, (void* (*)(void*)) routine, args, NULL);
+    t.task_seq = pool->task_seq++;
+    if ( pool->state == threadpool_state_normal ){
+        cond_lock_er_lock(&pool->join);
+        cond_lock_er_disactivate(&pool->join);
     }
-    pool->pos = sz;
-    if ( pthread_create(&pool->manager, NULL, _manager_run, pool) < 0 ) FATALERROR;
-    return pool;
+    _task_queue_push(pool->resume_queue, &t);
 }
 
-/* immediately return */
-/* the actual thread will terminate until all previous tasks done */
-void
-threadpool_destroy(threadpool_t *pool)
+/* by manager, wakes up the getter */
+static void
+_future_resolve(threadpool_t *pool, future_t fut, void *value, future_status_t status)
 {
-    manager_event_t e;
-    e.event_type = manager_event_call_die;
-    if ( pthread_detach(pool->manager) < 0 ) FATALERROR;
-    _inform_manager(pool, &e);
+    future_list_entry_t *fe = &pool->future_list->entries[fut];
+    threadpool_fiber_t *waiter = fe->waiter;
+    fe->waiter = NULL;
+    fe->value = value;
+    fe->status = status;
+    cond_lock_er_activate(fe->fut_access);
+    if ( waiter ) _fiber_resume(pool, waiter);
+    if ( fe->cset ) _cset_push(fe->cset, fut);
+    if ( fe->then_routine ) _future_continue(pool, fe->then_routine, fe->then_args);
 }
 
-void
-threadpool_goroutine(threadpool_t *pool, void (*routine)(void*), void *args)
+/* by manager, the pool is done with the task, whether it ran or not */
+static void
+_task_release(threadpool_t *pool, task_t *t, int ran)
 {
-    manager_event_t e;
-    e.event_type = manager_event_task_addin;
-    e.data.task.task_type = task_goroutine;
-    e.data.task.task_func = (void* (*)(void*))routine;
-    e.data.task.task_argu = args;
-    _inform_manager(pool, &e);
+    if ( t->task_strand ) _strand_release(pool, t->task_strand);
+    if ( t->task_token ) threadpool_token_release(t->task_token);
+    if ( t->task_group ) _group_done(t->task_group);
+    threadpool_context_t *ctx = t->task_context;
+    __atomic_add_fetch(ran ? &ctx->completed : &ctx->cancelled, 1, __ATOMIC_RELAXED);
+    _group_done(&ctx->scope);
 }
 
-future_t 
-threadpool_gofuture(threadpool_t *pool, void* (*routine)(void*), void *args)
+/* by manager, for a task that will never run */
+static void
+_task_cancel(threadpool_t *pool, task_t *t)
 {
-    /* manager might be accessing a future_list_entry */
-    /* a potential realloc will destroy it */
-    cond_lock_lock(&pool->manager_inform);
-    future_t fut = _future_get_next(pool->future_list);
-    cond_lock_unlock(&pool->manager_inform);
+    if ( t->task_type == task_gofuture ){
+        _future_resolve(pool, t->task_fut, NULL, future_status_cancelled);
+    }
+    _task_release(pool, t, 0);
+}
 
-    future_list_entry_t *fe = &pool->future_list->entries[fut];
-    cond_lock_er_lock(fe->fut_access);
-    manager_event_t e;
-    e.event_type = manager_event_task_addin;
-    e.data.task.task_type = task_gofuture;
-    e.data.task.task_func = routine;
-    e.data.task.task_argu = args;
-    e.data.task.task_fut  = fut;
-    _inform_manager(pool, &e);
-    return fut;
+static int
+_task_has_token(task_t *t, void *token)
+{
+    return t->task_token == token;
 }
 
-void*
-threadpool_get(threadpool_t *pool, future_t fut)
+static int
+_task_any(task_t *t, void *dumb)
 {
-    void *res;
-    future_list_entry_t *fe = &pool->future_list->entries[fut];
-    cond_lock_ee_wait(fe->fut_access);
-    res = fe->value;
-    cond_lock_ee_finish(fe->fut_access);
-    _future_put_available(pool->future_list, fut);
-    return res;
+    return 1;
 }
 
-void
-threadpool_join(threadpool_t *pool)
+static void
+_task_drop(task_t *t, void *pool)
 {
-    cond_lock_ee_wait(&pool->join);
-    cond_lock_unlock(&pool->join);
+    _task_cancel((threadpool_t*)pool, t);
+}
+
+static int
+_task_cancelled(task_t *t)
+{
+    return t->task_token && threadpool_token_cancelled(t->task_token);
+}
+
+/* tag limit utilities */
+
+static size_t
+_task_queue_count(task_queue_t *qu)
+{
+    return (qu->tail + qu->size - qu->head) % qu->size;
+}
+
+/* by manager, takes a token if it may start now */
+static int
+_tag_admit(threadpool_t *pool, tag_state_t *ts, uint64_t now)
+{
+    if ( ts->limits.max_running && ts->running >= ts->limits.max_running ) return 0;
+    if ( !ts->limits.rate ) return 1;
+
+    unsigned burst = ts->limits.burst ? ts->limits.burst : 1;
+    ts->tokens += (double)(now - ts->refilled_ms) * ts->limits.rate / 1000;
+    if ( ts->tokens > burst ) ts->tokens = burst;
+    ts->refilled_ms = now;
+    if ( ts->tokens >= 1 ){
+        ts->tokens -= 1;
+        return 1;
+    }
+    uint64_t ready = now + 1 + (uint64_t)((1 - ts->tokens) * 1000 / ts->limits.rate);
+    if ( !pool->tags_wakeup || ready < pool->tags_wakeup ) pool->tags_wakeup = ready;
+    return 0;
+}
+
+static void
+_tag_hold(threadpool_t *pool, tag_state_t *ts, task_t *t)
+{
+    if ( !ts->held ) ts->held = _task_queue_create(&pool->allocator, 4);
+    _task_queue_push(ts->held, t);
+    pool->tags_held++;
+}
+
+/* by manager, a held task whose tag lets it start now */
+static task_t*
+_tag_release(threadpool_t *pool, uint64_t now)
+{
+    if ( pool->tags_held == 0 ) return NULL;
+    for ( unsigned i = 0; i < THREADPOOL_TAGS; i++ ){
+        unsigned tag = (pool->tags_cursor + i) % THREADPOOL_TAGS;
+        tag_state_t *ts = &pool->tag_states[tag];
+        if ( !ts->held || _task_queue_empty(ts->held) ) continue;
+        if ( !_tag_admit(pool, ts, now) ) continue;
+        pool->tags_cursor = tag + 1;
+        pool->tags_held--;
+        return _task_queue_pop(ts->held);
+    }
+    return NULL;
+}
+
+/* by manager, for a task popped from a context; NULL if it was held instead */
+static task_t*
+_tag_check(threadpool_t *pool, task_t *t, uint64_t now)
+{
+    tag_state_t *ts = &pool->tag_states[ t->task_tag ];
+    /* behind the ones of its tag already held */
+    if ( (ts->held && !_task_queue_empty(ts->held)) || !_tag_admit(pool, ts, now) ){
+        _tag_hold(pool, ts, t);
+        return NULL;
+    }
+    return t;
+}
+
+/* by manager */
+static void
+_tag_remove_if(threadpool_t *pool, int (*pred)(task_t*, void*), void *arg)
+{
+    for ( unsigned tag = 0; tag < THREADPOOL_TAGS; tag++ ){
+        task_queue_t *held = pool->tag_states[tag].held;
+        if ( !held ) continue;
+        pool->tags_held -= _task_queue_count(held);
+        _task_queue_remove_if(held, pred, arg, _task_drop, pool);
+        pool->tags_held += _task_queue_count(held);
+    }
+}
+
+static void
+_inform_manager(threadpool_t *pool, manager_event_t *e)
+{
+    cond_lock_er_lock(&pool->manager_inform);
+    if ( e->event_type == manager_event_task_addin ) e->data.task.task_seq = pool->task_seq++;
+    _event_queue_push(pool->event_queue, e);
+    cond_lock_er_activate(&pool->manager_inform);
+}
+
+/* liveness utilities */
+
+static threadpool_life_t*
+_life_create(threadpool_t *pool)
+{
+    threadpool_life_t *life = (threadpool_life_t*) _pool_malloc(&pool->allocator, sizeof(threadpool_life_t));
+    life->allocator = pool->allocator;
+    cond_lock_init(&life->lock);
+    life->pool = pool;
+    life->refs = 1;
+    return life;
+}
+
+static void
+_life_acquire(threadpool_life_t *life)
+{
+    __atomic_add_fetch(&life->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void
+_life_release(threadpool_life_t *life)
+{
+    if ( __atomic_sub_fetch(&life->refs, 1, __ATOMIC_ACQ_REL) == 0 ){
+        cond_lock_destroy(&life->lock);
+        _pool_free(&life->allocator, life);
+    }
+}
+
+/* returns 0 if the pool is gone already, the event was not delivered then */
+static int
+_life_inform(threadpool_life_t *life, manager_event_t *e)
+{
+    cond_lock_lock(&life->lock);
+    threadpool_t *pool = life->pool;
+    if ( pool ) _inform_manager(pool, e);
+    cond_lock_unlock(&life->lock);
+    return pool != NULL;
+}
+
+/* by the dying manager after letting go of manager_inform, nothing reaches the pool through life from now on */
+static void
+_life_end(threadpool_t *pool)
+{
+    cond_lock_lock(&pool->life->lock);
+    pool->life->pool = NULL;
+    cond_lock_unlock(&pool->life->lock);
+}
+
+/* io utilities */
+
+/* by the io thread, no manager round trip unless a fiber or a continuation is waiting */
+static void
+_future_resolve_async(threadpool_t *pool, future_t fut, void *value)
+{
+    cond_lock_lock(&pool->manager_inform);
+    future_list_entry_t *fe = &pool->future_list->entries[fut];
+    threadpool_fiber_t *waiter = fe->waiter;
+    void (*then_routine)(void*) = fe->then_routine;
+    void *then_args = fe->then_args;
+    fe->waiter = NULL;
+    fe->value = value;
+    fe->status = future_status_ok;
+    cond_lock_er_activate(fe->fut_access);
+    if ( fe->cset ) _cset_push(fe->cset, fut);
+    cond_lock_unlock(&pool->manager_inform);
+
+    if ( waiter ){
+        manager_event_t e;
+        e.event_type = manager_event_fiber_resume;
+        e.data.fiber = waiter;
+        _inform_manager(pool, &e);
+    }
+    if ( then_routine ){
+        /* through the manager, ahead of queued tasks and even while dying */
+        manager_event_t e;
+        e.event_type = manager_event_future_continue;
+        e.data.cont.routine = then_routine;
+        e.data.cont.args = then_args;
+        _inform_manager(pool, &e);
+    }
+}
+
+static void
+_io_done(io_request_t *req, long res)
+{
+    threadpool_io_op_t *op = (threadpool_io_op_t*) req;
+    threadpool_t *pool = op->pool;
+    future_t fut = op->fut;
+    _pool_free(&pool->allocator, op);
+    _future_resolve_async(pool, fut, (void*)(intptr_t) res);
+}
+
+static io_engine_t*
+_io_engine(threadpool_t *pool)
+{
+    io_engine_t *io = __atomic_load_n(&pool->io, __ATOMIC_ACQUIRE);
+    if ( io ) return io;
+
+    cond_lock_lock(&pool->manager_inform);
+    io = pool->io;
+    if ( !io ){
+        io = (io_engine_t*) _pool_malloc(&pool->allocator, sizeof(io_engine_t));
+        io_engine_init(io, pool->io_backend == threadpool_io_auto);
+        __atomic_store_n(&pool->io, io, __ATOMIC_RELEASE);
+    }
+    cond_lock_unlock(&pool->manager_inform);
+    return io;
+}
+
+/* affinity utilities */
+
+/* by manager, a task of worker ind's own queue */
+static task_t*
+_affine_pop(threadpool_t *pool, index_t ind)
+{
+    task_t *t = _task_queue_pop(pool->affine[ind]);
+    if ( t ) pool->affine_queued--;
+    return t;
+}
+
+/* by manager, whether worker ind is in the available stack */
+static int
+_worker_free(threadpool_t *pool, index_t ind)
+{
+    for ( size_t slot = 0; slot < pool->pos; slot++ ){
+        if ( pool->worker_available_stack[slot] == ind ) return 1;
+    }
+    return 0;
+}
+
+/* by manager, the oldest task of the busy worker furthest behind, if any is behind enough */
+static task_t*
+_affine_steal(threadpool_t *pool)
+{
+    task_queue_t *victim = NULL;
+    size_t most = WORKER_AFFINITY_STEAL - 1;
+    for ( size_t i = 0; i < pool->size; i++ ){
+        size_t n = _task_queue_count(pool->affine[i]);
+        /* a free owner takes its own, only a busy one's backlog is up for grabs */
+        if ( n > most && !_worker_free(pool, i) ){
+            victim = pool->affine[i];
+            most = n;
+        }
+    }
+    if ( !victim ) return NULL;
+    pool->affine_queued--;
+    return _task_queue_pop(victim);
+}
+
+/* by manager, t is about to start: charged to its context and admitted by its tag like any other; */
+/* NULL if it was cancelled, or held, where it waits with the rest of its tag and loses the hint */
+static task_t*
+_affine_admit(threadpool_t *pool, task_t *t, uint64_t now)
+{
+    if ( _task_cancelled(t) ){
+        _task_cancel(pool, t);
+        return NULL;
+    }
+    if ( pool->tags_limited && _tag_check(pool, t, now) == NULL ) return NULL;
+    threadpool_context_t *ctx = t->task_context;
+    if ( ctx->pass < pool->vtime ) ctx->pass = pool->vtime;
+    ctx->pass += CONTEXT_STRIDE / ctx->weight;
+    return t;
+}
+
+/* by manager */
+static void
+_affine_remove_if(threadpool_t *pool, int (*pred)(task_t*, void*), void *arg)
+{
+    for ( size_t i = 0; i < pool->size; i++ ){
+        pool->affine_queued -= _task_queue_count(pool->affine[i]);
+        _task_queue_remove_if(pool->affine[i], pred, arg, _task_drop, pool);
+        pool->affine_queued += _task_queue_count(pool->affine[i]);
+    }
+}
+
+/* trace utilities */
+
+static void
+_trace_append(threadpool_trace_t *tr, task_t *t, index_t worker)
+{
+    if ( tr->count == tr->size ){
+        tr->size = tr->size ? tr->size * 2 : 64;
+        tr->entries = (threadpool_trace_entry_t*) _pool_realloc(&tr->allocator, tr->entries, sizeof(threadpool_trace_entry_t) * tr->size);
+    }
+    threadpool_trace_entry_t *en = &tr->entries[ tr->count++ ];
+    en->seq = t->task_seq;
+    en->worker = (uint32_t) worker;
+    en->resume = t->task_type == task_resume;
+}
+
+static uint64_t
+_trace_rand(threadpool_trace_t *tr)
+{
+    uint64_t x = tr->seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    tr->seed = x;
+    return x;
+}
+
+/* by manager, nothing running and nothing on its way could still bring the entry */
+static int
+_trace_stalled(threadpool_t *pool, threadpool_trace_entry_t *en)
+{
+    return en->seq < pool->task_seq && pool->pos == pool->size && pool->fibers_suspended == 0 && pool->tags_held == 0;
+}
+
+/* by manager, which ready task goes to which free worker next; 0 to wait */
+static int
+_trace_choose(threadpool_t *pool, size_t *i, size_t *slot)
+{
+    task_queue_t *ready = pool->trace_ready;
+    size_t n = _task_queue_count(ready);
+    if ( n == 0 ) return 0;
+    threadpool_trace_t *tr = pool->trace;
+
+    if ( pool->trace_mode == threadpool_trace_simulate ){
+        *i = _trace_rand(tr) % n;
+        /* the only worker */
+        *slot = 0;
+        return 1;
+    }
+
+    /* recorded on a wider pool, no worker here will ever take it */
+    if ( !tr->diverged && tr->pos < tr->count && tr->entries[tr->pos].worker >= pool->size ) tr->diverged = 1;
+    if ( !tr->diverged && tr->pos < tr->count ){
+        threadpool_trace_entry_t *en = &tr->entries[tr->pos];
+        for ( *i = 0; *i < n; (*i)++ ){
+            task_t *t = &ready->tasks[ (ready->head + *i) % ready->size ];
+            if ( t->task_seq == en->seq && (t->task_type == task_resume) == !!en->resume ) break;
+        }
+        if ( *i < n ){
+            for ( *slot = 0; *slot < pool->pos; (*slot)++ ){
+                if ( pool->worker_available_stack[*slot] == en->worker ) break;
+            }
+            /* its worker is still busy */
+            if ( *slot == pool->pos ) return 0;
+            tr->pos++;
+            return 1;
+        }
+        if ( !_trace_stalled(pool, en) ) return 0;
+        tr->diverged = 1;
+    }
+    /* past the trace, or off it */
+    *i = 0;
+    *slot = pool->pos - 1;
+    return 1;
+}
+
+/* by manager, into the queue it is dispatched from */
+static void
+_task_enqueue(threadpool_t *pool, task_t *t)
+{
+    /* traces pick among the context queues only */
+    if ( t->task_worker != TASK_ANY_WORKER && !pool->trace_ready ){
+        _task_queue_push(pool->affine[ t->task_worker ], t);
+        pool->affine_queued++;
+    }else{
+        _context_push(pool, t->task_context, t);
+    }
+}
+
+/* by manager, ready strands queue their next task */
+static void
+_strands_flush(threadpool_t *pool)
+{
+    while ( pool->strands_ready ){
+        threadpool_strand_t *st = pool->strands_ready;
+        pool->strands_ready = st->next_ready;
+        task_t t = *_task_queue_pop(st->waiting);
+        if ( pool->state == threadpool_state_about_to_die && pool->shutdown_mode == threadpool_shutdown_cancel ){
+            /* puts st back if more wait */
+            _task_cancel(pool, &t);
+            continue;
+        }
+        _task_enqueue(pool, &t);
+    }
+}
+
+/* by manager, the next task to start, NULL if none may */
+static task_t*
+_manager_next_task(threadpool_t *pool, uint64_t now)
+{
+    for ( ; ; ){
+        task_t *t = _task_queue_pop(pool->resume_queue);
+        if ( t == NULL ) t = _tag_release(pool, now);
+        if ( t == NULL ){
+            t = _context_pop(pool);
+            if ( t == NULL ) return NULL;
+            if ( pool->tags_limited && !_task_cancelled(t) && _tag_check(pool, t, now) == NULL ) continue;
+        }
+        /* cancelled after it was queued */
+        if ( _task_cancelled(t) ){
+            _task_cancel(pool, t);
+            continue;
+        }
+        return t;
+    }
+}
+
+/* by manager, hands t to the free worker at slot of the available stack */
+static void
+_manager_dispatch(threadpool_t *pool, task_t *t, size_t slot)
+{
+    index_t ind = pool->worker_available_stack[slot];
+    pool->worker_available_stack[slot] = pool->worker_available_stack[--pool->pos];
+    if ( pool->trace_mode == threadpool_trace_record || pool->trace_mode == threadpool_trace_simulate ){
+        _trace_append(pool->trace, t, ind);
+    }
+    if ( t->task_type != task_resume ) pool->tag_states[ t->task_tag ].running++;
+
+    worker_t *wk = &pool->workers[ind];
+    wk->task = *t;
+    if ( pool->fiber_stack_size && t->task_type != task_resume ){
+        threadpool_fiber_t *f = _fiber_get(pool);
+        f->task = *t;
+        wk->task.task_fiber = f;
+    }
+    cond_lock_er_lock(&wk->worker_wakeup);
+    cond_lock_er_activate(&wk->worker_wakeup);
+}
+
+/* by manager, how many tasks the next worker gets; 1 unless the queues hold more than a round of work */
+static size_t
+_manager_batch_size(threadpool_t *pool)
+{
+    /* fibers and traces want every dispatch to go through the manager */
+    if ( pool->fiber_stack_size || pool->trace_mode != threadpool_trace_off ) return 1;
+    size_t queued = 0;
+    for ( size_t i = 0; i < pool->contexts_cnt; i++ ){
+        queued += _task_queue_count(pool->contexts[i]->task_queue);
+    }
+    size_t n = 1 + queued / pool->size;
+    return n < WORKER_BATCH ? n : WORKER_BATCH;
+}
+
+/* by manager, t and up to n - 1 more tasks to the next free worker */
+static void
+_manager_dispatch_batch(threadpool_t *pool, task_t *t, size_t n, uint64_t now)
+{
+    worker_t *wk = &pool->workers[ pool->worker_available_stack[--pool->pos] ];
+    /* copied first, popping more may move the queue t is in */
+    wk->batch[0] = *t;
+    size_t cnt = 1;
+    /* counted as they go, a tag's max_running holds within the batch */
+    pool->tag_states[ t->task_tag ].running++;
+    while ( cnt < n && (t = _manager_next_task(pool, now)) != NULL ){
+        wk->batch[cnt++] = *t;
+        pool->tag_states[ t->task_tag ].running++;
+    }
+    wk->batch_cnt = cnt;
+    wk->batch_done = 0;
+    wk->batch_reported = 0;
+    wk->task.task_type = task_batch;
+    wk->task.task_fiber = NULL;
+    cond_lock_er_lock(&wk->worker_wakeup);
+    cond_lock_er_activate(&wk->worker_wakeup);
+}
+
+/* by manager, replay and simulate */
+static void
+_trace_assign(threadpool_t *pool, uint64_t now)
+{
+    task_t *t;
+    while ( (t = _manager_next_task(pool, now)) != NULL ){
+        _task_queue_push(pool->trace_ready, t);
+    }
+    if ( !pool->trace_started ) return;
+
+    size_t i, slot;
+    while ( pool->pos > 0 && _trace_choose(pool, &i, &slot) ){
+        task_t task;
+        _task_queue_take(pool->trace_ready, i, &task);
+        /* cancelled while it was ready */
+        if ( _task_cancelled(&task) ){
+            _task_cancel(pool, &task);
+            continue;
+        }
+        _manager_dispatch(pool, &task, slot);
+    }
+}
+
+static void
+_manager_assign_round(threadpool_t *pool)
+{
+    /* recomputed by whatever stays held for lack of tokens */
+    pool->tags_wakeup = 0;
+    uint64_t now = pool->tags_held || pool->tags_limited ? _clock_ms() : 0;
+    _strands_flush(pool);
+    if ( pool->trace_ready ){
+        _trace_assign(pool, now);
+        return;
+    }
+    /* free workers with tasks of their own take those first, wherever they are in the stack */
+    for ( size_t slot = pool->pos; pool->affine_queued > 0 && slot-- > 0; ){
+        index_t ind = pool->worker_available_stack[slot];
+        task_t *t = NULL;
+        while ( t == NULL && (t = _affine_pop(pool, ind)) != NULL ) t = _affine_admit(pool, t, now);
+        if ( t == NULL ) continue;
+        /* the top of the stack moves into slot, which is below the rest still to look at */
+        _manager_dispatch(pool, t, slot);
+    }
+    while ( pool->pos > 0 ){
+        task_t *t = _manager_next_task(pool, now);
+        if ( t == NULL && pool->affine_queued > 0 ){
+            t = _affine_steal(pool);
+            if ( t && (t = _affine_admit(pool, t, now)) == NULL ) continue;
+        }
+        if ( t == NULL ) break;
+        size_t n = _manager_batch_size(pool);
+        if ( n > 1 ) _manager_dispatch_batch(pool, t, n, now);
+        else _manager_dispatch(pool, t, pool->pos - 1);
+    }
+}
+
+static void
+_manager_assign_task(threadpool_t *pool)
+{
+    /* a strand's task cancelled on the way readies the next one */
+    do {
+        _manager_assign_round(pool);
+    } while ( pool->strands_ready );
+}
+
+static int
+_all_worker_available(threadpool_t *pool)
+{
+    return pool->size == pool->pos;
+}
+
+/* precondition: all worker available, no task, manager_inform held */
+static void
+_do_destroy_all(threadpool_t *pool)
+{
+    for ( size_t i = 0; i < pool->size; i++ ){
+        worker_t *wk = &pool->workers[i];
+        wk->task.task_type = task_die;
+        wk->task.task_fiber = NULL;
+        cond_lock_er_lock(&wk->worker_wakeup);
+        cond_lock_er_activate(&wk->worker_wakeup);
+        if ( pthread_join(wk->worker, NULL) < 0 ) FATALERROR;
+
+        cond_lock_destroy(&wk->worker_wakeup);
+    }
+
+    /* getters woken by the last completions still touch the pool */
+    cond_lock_ee_finish(&pool->manager_inform);
+    /* after letting go of manager_inform, io completions take it */
+    if ( pool->io ){
+        io_engine_destroy(pool->io);
+        _pool_free(&pool->allocator, pool->io);
+    }
+    while ( __atomic_load_n(&pool->getters, __ATOMIC_ACQUIRE) > 0 ){
+        sched_yield();
+    }
+    /* cancels and timers that made it in before the end hold refs */
+    _life_end(pool);
+    manager_event_t *e;
+    while ( (e = _event_queue_pop(pool->event_queue)) != NULL ){
+        if ( e->event_type == manager_event_token_cancel ) threadpool_token_release(e->data.token);
+        if ( e->event_type == manager_event_timer_add || e->event_type == manager_event_timer_cancel ){
+            threadpool_timer_release(e->data.timer);
+        }
+    }
+    _life_release(pool->life);
+
+    cond_lock_destroy(&pool->manager_inform);
+    cond_lock_destroy(&pool->join);
+
+    _event_queue_destroy(pool->event_queue);
+    _future_list_destroy(pool->future_list);
+    for ( size_t i = 0; i < pool->contexts_cnt; i++ ){
+        _context_destroy(pool->contexts[i]);
+    }
+    _pool_free(&pool->allocator, pool->contexts);
+    _task_queue_destroy(pool->resume_queue);
+    for ( size_t i = 0; i < THREADPOOL_TAGS; i++ ){
+        if ( pool->tag_states[i].held ) _task_queue_destroy(pool->tag_states[i].held);
+    }
+    if ( pool->trace_ready ) _task_queue_destroy(pool->trace_ready);
+    for ( size_t i = 0; i < pool->size; i++ ){
+        _task_queue_destroy(pool->affine[i]);
+    }
+    _pool_free(&pool->allocator, pool->affine);
+    while ( pool->fibers_free ){
+        threadpool_fiber_t *f = pool->fibers_free;
+        pool->fibers_free = f->next;
+        fiber_destroy(&f->fiber);
+        _pool_free(&pool->allocator, f);
+    }
+
+    _pool_free(&pool->allocator, pool->workers);
+    _pool_free(&pool->allocator, pool->worker_available_stack);
+    _pool_free(&pool->allocator, pool);
+
+    cond_lock_lock(&shutdowns_lock);
+    if ( --shutdowns == 0 ) cond_lock_broadcast(&shutdowns_lock);
+    cond_lock_unlock(&shutdowns_lock);
+    pthread_exit(NULL);
+}
+
+/* nothing queued and nothing running: wake joiners, or finish dying */
+static void
+_manager_check_idle(threadpool_t *pool)
+{
+    if ( !_all_worker_available(pool) || !_contexts_empty(pool) || pool->tags_held > 0 || pool->affine_queued > 0 ) return;
+    if ( pool->strands_ready ) return;
+    if ( pool->trace_ready && !_task_queue_empty(pool->trace_ready) ) return;
+    if ( !_task_queue_empty(pool->resume_queue) || pool->fibers_suspended > 0 ) return;
+    switch (pool->state){
+        case threadpool_state_about_to_die:
+            _do_destroy_all(pool);
+            return;
+        case threadpool_state_normal:
+            cond_lock_er_lock(&pool->join);
+            cond_lock_er_activate(&pool->join);
+            break;
+        default:
+            assert(0);
+    }
+}
+
+static void
+_manager_handle_event_call_die(threadpool_t *pool, threadpool_shutdown_mode_t mode)
+{
+    pool->state = threadpool_state_about_to_die;
+    pool->shutdown_mode = mode;
+    timer_wheel_clear(&pool->timers, _timer_drop, NULL);
+
+    if ( mode == threadpool_shutdown_cancel ){
+        task_t *t;
+        while ( (t = _context_pop(pool)) != NULL ){
+            _task_cancel(pool, t);
+        }
+        _tag_remove_if(pool, _task_any, NULL);
+        _affine_remove_if(pool, _task_any, NULL);
+        if ( pool->trace_ready ) _task_queue_remove_if(pool->trace_ready, _task_any, NULL, _task_drop, pool);
+    }
+
+    /* fibers waiting on what was just cancelled still have to finish; strands drop what waits in them */
+    _manager_assign_task(pool);
+    _manager_check_idle(pool);
+}
+
+static void
+_manager_handle_event_task_addin(threadpool_t *pool, task_t *t)
+{
+    threadpool_strand_t *st = t->task_strand;
+    if ( st ){
+        /* cancelled or not, it waits for its turn behind the one in flight */
+        if ( st->busy ){
+            _task_queue_push(st->waiting, t);
+            return;
+        }
+        st->busy = 1;
+    }
+    if ( _task_cancelled(t) ){
+        _task_cancel(pool, t);
+        _manager_assign_task(pool);
+        return;
+    }
+    switch (pool->state) {
+        case threadpool_state_normal:
+            cond_lock_er_lock(&pool->join);
+            cond_lock_er_disactivate(&pool->join);
+            _task_enqueue(pool, t);
+            _manager_assign_task(pool);
+            break;
+        case threadpool_state_about_to_die:
+            /* submitted after shutdown */
+            _task_cancel(pool, t);
+            _manager_assign_task(pool);
+            break;
+        default:
+            assert(0);
+    }
+}
+
+/* by manager, from the wheel */
+static void
+_timer_expire(timer_node_t *node, void *args)
+{
+    threadpool_t *pool = (threadpool_t*) args;
+    threadpool_timer_t *timer = (threadpool_timer_t*) node;
+    task_t t;
+    _task_init(pool, &t, task_goroutine, (void* (*)(void*)) timer->routine, timer->args, NULL);
+    t.task_seq = pool->task_seq++;
+    _manager_handle_event_task_addin(pool, &t);
+
+    if ( timer->period ){
+        /* keeps the phase, runs missed while the manager lagged are skipped */
+        uint64_t next = node->expires + timer->period;
+        if ( next <= pool->timers.now ) next = pool->timers.now + timer->period;
+        timer_wheel_add(&pool->timers, node, next);
+        return;
+    }
+    timer->armed = 0;
+    /* the wheel's ref */
+    threadpool_timer_release(timer);
+}
+
+static void
+_manager_handle_event_timer_add(threadpool_t *pool, threadpool_timer_t *timer)
+{
+    if ( pool->state == threadpool_state_about_to_die || __atomic_load_n(&timer->cancelled, __ATOMIC_ACQUIRE) ){
+        threadpool_timer_release(timer);
+        return;
+    }
+    /* the event's ref goes to the wheel */
+    timer->armed = 1;
+    timer_wheel_add(&pool->timers, &timer->node, timer->node.expires);
+}
+
+static void
+_manager_handle_event_timer_cancel(threadpool_t *pool, threadpool_timer_t *timer)
+{
+    if ( timer->armed ){
+        timer_wheel_del(&pool->timers, &timer->node);
+        timer->armed = 0;
+        threadpool_timer_release(timer);
+    }
+    /* the ref taken for this event */
+    threadpool_timer_release(timer);
+}
+
+static void
+_manager_handle_event_token_cancel(threadpool_t *pool, threadpool_token_t *token)
+{
+    for ( size_t i = 0; i < pool->contexts_cnt; i++ ){
+        _task_queue_remove_if(pool->contexts[i]->task_queue, _task_has_token, token, _task_drop, pool);
+    }
+    _tag_remove_if(pool, _task_has_token, token);
+    _affine_remove_if(pool, _task_has_token, token);
+    if ( pool->trace_ready ) _task_queue_remove_if(pool->trace_ready, _task_has_token, token, _task_drop, pool);
+    /* the ref taken for this event */
+    threadpool_token_release(token);
+    _manager_assign_task(pool);
+    _manager_check_idle(pool);
+}
+
+static void
+_manager_handle_event_tag_limit(threadpool_t *pool, unsigned tag, const threadpool_tag_limits_t *limits)
+{
+    tag_state_t *ts = &pool->tag_states[tag];
+    int was = ts->limits.max_running || ts->limits.rate;
+    int is = limits->max_running || limits->rate;
+    pool->tags_limited += is - was;
+    ts->limits = *limits;
+    /* starts with a full bucket */
+    ts->tokens = limits->burst ? limits->burst : 1;
+    ts->refilled_ms = _clock_ms();
+    /* looser limits may let held tasks go */
+    _manager_assign_task(pool);
+    _manager_check_idle(pool);
+}
+
+/* by manager, t ran to the end */
+static void
+_manager_task_done(threadpool_t *pool, task_t *t, void *res)
+{
+    if ( t->task_type == task_gofuture && t->task_error ){
+        _future_resolve(pool, t->task_fut, (void*)(intptr_t) t->task_error, future_status_error);
+    }else if ( t->task_type == task_gofuture ){
+        _future_resolve(pool, t->task_fut, res, future_status_ok);
+    }
+    _task_release(pool, t, 1);
+    pool->tag_states[ t->task_tag ].running--;
+    if ( t->task_fiber ) _fiber_put(pool, t->task_fiber);
+}
+
+/* by manager, the batch up to upto is finished */
+static void
+_manager_drain_batch(threadpool_t *pool, worker_t *wk, size_t upto)
+{
+    for ( ; wk->batch_reported < upto; wk->batch_reported++ ){
+        task_t *t = &wk->batch[ wk->batch_reported ];
+        /* never started, its token was cancelled in the meantime */
+        if ( !t->task_started_ns ){
+            _task_cancel(pool, t);
+            pool->tag_states[ t->task_tag ].running--;
+            continue;
+        }
+        _manager_task_done(pool, t, wk->batch_res[ wk->batch_reported ]);
+    }
+}
+
+static void
+_manager_handle_event_worker_progress(threadpool_t *pool, index_t worker_ind)
+{
+    worker_t *wk = &pool->workers[worker_ind];
+    _manager_drain_batch(pool, wk, __atomic_load_n(&wk->batch_done, __ATOMIC_ACQUIRE));
+    /* continuations of what just resolved */
+    _manager_assign_task(pool);
+}
+
+static void
+_manager_handle_event_worker_done(threadpool_t *pool, index_t worker_ind)
+{
+    worker_t *wk = &pool->workers[worker_ind];
+    if ( wk->task.task_type == task_batch ){
+        _manager_drain_batch(pool, wk, wk->batch_cnt);
+    }else{
+        _manager_task_done(pool, &wk->task, wk->worker_task_res);
+    }
+    pool->worker_available_stack[ pool->pos++ ] = worker_ind;
+
+    _manager_assign_task(pool);
+    _manager_check_idle(pool);
+}
+
+static void
+_manager_handle_event_fiber_suspend(threadpool_t *pool, index_t worker_ind)
+{
+    threadpool_fiber_t *f = pool->workers[worker_ind].task.task_fiber;
+    future_list_entry_t *fe = &pool->future_list->entries[f->wait_fut];
+    pool->fibers_suspended++;
+    if ( fe->status == future_status_pending ){
+        fe->waiter = f;
+    }else{
+        /* resolved while it was switching out */
+        _fiber_resume(pool, f);
+    }
+    pool->worker_available_stack[ pool->pos++ ] = worker_ind;
+    _manager_assign_task(pool);
+}
+
+static void
+_manager_handle_event_fiber_resume(threadpool_t *pool, threadpool_fiber_t *f)
+{
+    _fiber_resume(pool, f);
+    _manager_assign_task(pool);
+}
+
+struct worker_args_s {
+    threadpool_t    *pool;
+    index_t         this_ind;
+};
+
+static void*
+_manager_run(void *args)
+{
+    threadpool_t *pool = (threadpool_t*) args;
+    for ( size_t i = 0; i < pool->size; i++ ){
+        struct worker_args_s *worker_args = (struct worker_args_s*) _pool_malloc(&pool->allocator, sizeof(struct worker_args_s));
+        worker_args->pool = pool;
+        worker_args->this_ind = i;
+        if ( pthread_create(&pool->workers[i].worker, NULL, _worker_run, worker_args) < 0 ) FATALERROR;
+    }
+
+    for ( ; ; ){
+        uint64_t next = pool->timers.count > 0 ? timer_wheel_next(&pool->timers) : 0;
+        if ( pool->tags_wakeup && (!next || pool->tags_wakeup < next) ) next = pool->tags_wakeup;
+        if ( next ){
+            struct timespec abstime = { (time_t)(next / 1000), (long)(next % 1000) * 1000000 };
+            cond_lock_ee_timedwait(&pool->manager_inform, &abstime);
+        }else{
+            cond_lock_ee_wait(&pool->manager_inform);
+        }
+        /* due timers first, so that new ones are scheduled against a fresh now */
+        uint64_t now = _clock_ms();
+        timer_wheel_advance(&pool->timers, now, _timer_expire, pool);
+        /* held tasks got their tokens */
+        if ( pool->tags_wakeup && now >= pool->tags_wakeup ){
+            _manager_assign_task(pool);
+            _manager_check_idle(pool);
+        }
+
+        /* events received, if not woken up by a timer */
+        manager_event_t *e;
+        while ( (e = _event_queue_pop(pool->event_queue)) != NULL ){
+            switch ( e->event_type ){
+                    break;
+                case manager_event_call_die:
+                    _manager_handle_event_call_die(pool, e->data.shutdown_mode);
+                    break;
+                case manager_event_task_addin:
+                    _manager_handle_event_task_addin(pool, &e->data.task);
+                    break;
+                case manager_event_token_cancel:
+                    _manager_handle_event_token_cancel(pool, e->data.token);
+                    break;
+                case manager_event_timer_add:
+                    _manager_handle_event_timer_add(pool, e->data.timer);
+                    break;
+                case manager_event_timer_cancel:
+                    _manager_handle_event_timer_cancel(pool, e->data.timer);
+                    break;
+                case manager_event_tag_limit:
+                    _manager_handle_event_tag_limit(pool, e->data.tag_limit.tag, &e->data.tag_limit.limits);
+                    break;
+                case manager_event_trace_start:
+                    pool->trace_started = 1;
+                    _manager_assign_task(pool);
+                    break;
+                case manager_event_worker_done:
+                    _manager_handle_event_worker_done(pool, e->data.worker_ind);
+                    break;
+                case manager_event_fiber_suspend:
+                    _manager_handle_event_fiber_suspend(pool, e->data.worker_ind);
+                    break;
+                case manager_event_worker_progress:
+                    _manager_handle_event_worker_progress(pool, e->data.worker_ind);
+                    break;
+                case manager_event_fiber_resume:
+                    _manager_handle_event_fiber_resume(pool, e->data.fiber);
+                    break;
+                case manager_event_future_continue:
+                    _future_continue(pool, e->data.cont.routine, e->data.cont.args);
+                    _manager_assign_task(pool);
+                    break;
+                default:
+                    assert(0);
+            }
+        }
+        /* dispatch drops tasks cancelled on the way, which may leave the pool idle after the handler checked */
+        _manager_check_idle(pool);
+        cond_lock_ee_finish(&pool->manager_inform);
+    }
+}
+
+/* returns non zero if the fiber suspended rather than finished */
+static int
+_worker_run_fiber(worker_t *wk, threadpool_fiber_t *f)
+{
+    f->worker = wk;
+    f->state = fiber_state_running;
+    current_fiber = f;
+    current_token = f->task.task_token;
+    _task_account_begin(&f->task);
+    fiber_switch(&wk->sched, &f->fiber.ctx);
+    _task_account_end(&f->task);
+    current_fiber = NULL;
+    current_token = NULL;
+    if ( f->state == fiber_state_suspended ) return 1;
+    _task_account(f->pool, &f->task);
+
+    /* what the manager expects of a finished task */
+    wk->task = f->task;
+    wk->task.task_fiber = f;
+    wk->worker_task_res = f->res;
+    return 0;
+}
+
+/* somebody may be blocked on its completion, possibly a later task of the same batch */
+static int
+_task_awaited(threadpool_t *pool, task_t *t)
+{
+    return t->task_type == task_gofuture || t->task_group || t->task_strand || t->task_context != pool->default_context;
+}
+
+/* runs the whole batch; plain goroutines are reported now and then rather than one by one */
+static void
+_worker_run_batch(threadpool_t *pool, index_t this_ind, worker_t *wk)
+{
+    uint64_t reported = _clock_ns(CLOCK_MONOTONIC);
+    for ( size_t i = 0; i < wk->batch_cnt; i++ ){
+        task_t *t = &wk->batch[i];
+        /* left with task_started_ns 0, the manager cancels it */
+        if ( !_task_cancelled(t) ){
+            current_token = t->task_token;
+            current_task = t;
+            _task_account_begin(t);
+            wk->batch_res[i] = _task_run(t);
+            _task_account_end(t);
+            _task_account(pool, t);
+        }
+        __atomic_store_n(&wk->batch_done, i + 1, __ATOMIC_RELEASE);
+
+        uint64_t now = _clock_ns(CLOCK_MONOTONIC);
+        if ( i + 1 < wk->batch_cnt && (_task_awaited(pool, t) || now - reported > WORKER_BATCH_FLUSH_NS) ){
+            manager_event_t e;
+            e.event_type = manager_event_worker_progress;
+            e.data.worker_ind = this_ind;
+            _inform_manager(pool, &e);
+            reported = now;
+        }
+    }
+}
+
+static void*
+_worker_run(void *args)
+{
+    struct worker_args_s *real_args = (struct worker_args_s*) args;
+    threadpool_t *pool = real_args->pool;
+    index_t this_ind = real_args->this_ind;
+    _pool_free(&pool->allocator, args);
+    worker_t *worker_self = &pool->workers[this_ind];
+
+    for ( ; ; ){
+        cond_lock_ee_wait(&worker_self->worker_wakeup);
+        /* a new task is received */
+        task_t *t = &worker_self->task;
+        manager_event_t e;
+        e.event_type = manager_event_worker_done;
+        e.data.worker_ind = this_ind;
+        if ( t->task_fiber ){
+            if ( _worker_run_fiber(worker_self, t->task_fiber) ) e.event_type = manager_event_fiber_suspend;
+            _inform_manager(pool, &e);
+            cond_lock_ee_finish(&worker_self->worker_wakeup);
+            continue;
+        }
+
+        current_token = t->task_token;
+        current_task = t;
+        switch ( t->task_type ){
+            case task_goroutine:
+            case task_gofuture:
+                _task_account_begin(t);
+                worker_self->worker_task_res = _task_run(t);
+                _task_account_end(t);
+                _task_account(pool, t);
+                break;
+            case task_batch:
+                _worker_run_batch(pool, this_ind, worker_self);
+                break;
+            case task_die:
+                pthread_exit(NULL);
+                break;
+            default:
+                assert(0);
+        }
+        current_token = NULL;
+        current_task = NULL;
+        _inform_manager(pool, &e);
+        cond_lock_ee_finish(&worker_self->worker_wakeup);
+    }
+    return NULL;
+}
+
+threadpool_t*
+threadpool_create(size_t sz)
+{
+    return threadpool_create_ex(sz, NULL);
+}
+
+threadpool_t*
+threadpool_create_ex(size_t sz, const threadpool_config_t *config)
+{
+    if ( !sz ) return NULL;
+    /* several workers would finish in whatever order they happen to */
+    if ( config && config->trace && config->trace_mode == threadpool_trace_simulate && sz != 1 ) return NULL;
+
+    /* all zero means memcheck */
+    threadpool_allocator_t al = { NULL, NULL, NULL, NULL };
+    if ( config && config->allocator ){
+        al = *config->allocator;
+        if ( !al.allocator_malloc || !al.allocator_realloc || !al.allocator_free ) return NULL;
+    }else{
+        memcheck_init();
+    }
+
+    threadpool_t *pool = (threadpool_t*) _pool_malloc(&al, sizeof(threadpool_t));
+    pool->allocator = al;
+    pool->life = _life_create(pool);
+    /* manager itself at last */
+    pool->state = threadpool_state_normal;
+    pool->shutdown_mode = threadpool_shutdown_drain;
+    cond_lock_init(&pool->manager_inform);
+    cond_lock_init(&pool->join);
+    
+    pool->event_queue = _event_queue_create(&pool->allocator, sz + 2);
+    pool->future_list = _future_list_create(&pool->allocator, sz);
+    
+    pool->size = sz;
+    pool->workers = (worker_t*) _pool_malloc(&pool->allocator, sizeof(worker_t) * sz);
+    for ( size_t i = 0; i < sz; i++ ){
+        worker_t *wk = &pool->workers[i];
+        cond_lock_init(&wk->worker_wakeup);
+    }
+    pool->worker_available_stack = (index_t*) _pool_malloc(&pool->allocator, sizeof(index_t) * sz);
+    for ( size_t i = 0; i < sz; i++ ){
+        pool->worker_available_stack[i] = sz - 1 - i;
+    }
+    pool->pos = sz;
+    pool->getters = 0;
+
+    pool->contexts_size = 4;
+    pool->contexts = (threadpool_context_t**) _pool_malloc(&pool->allocator, sizeof(threadpool_context_t*) * pool->contexts_size);
+    pool->default_context = _context_create(pool, 1);
+    pool->contexts[0] = pool->default_context;
+    pool->contexts_cnt = 1;
+    pool->vtime = 0;
+
+    pool->fiber_stack_size = config ? config->fiber_stack_size : 0;
+    pool->fibers_free = NULL;
+    pool->resume_queue = _task_queue_create(&pool->allocator, sz + 2);
+    pool->fibers_suspended = 0;
+
+    pool->io_backend = config ? config->io_backend : threadpool_io_auto;
+    pool->io = NULL;
+
+    timer_wheel_init(&pool->timers, _clock_ms());
+    memset(pool->tags, 0, sizeof(pool->tags));
+    memset(pool->tag_states, 0, sizeof(pool->tag_states));
+    pool->tags_limited = 0;
+    pool->tags_held = 0;
+    pool->tags_cursor = 0;
+    pool->tags_wakeup = 0;
+
+    pool->trace_mode = config && config->trace ? config->trace_mode : threadpool_trace_off;
+    pool->trace = config ? config->trace : NULL;
+    pool->trace_started = 0;
+    pool->trace_ready = NULL;
+    if ( pool->trace_mode == threadpool_trace_replay || pool->trace_mode == threadpool_trace_simulate ){
+        pool->trace_ready = _task_queue_create(&pool->allocator, sz + 2);
+    }
+    pool->task_seq = 0;
+
+    pool->affine = (task_queue_t**) _pool_malloc(&pool->allocator, sizeof(task_queue_t*) * sz);
+    for ( size_t i = 0; i < sz; i++ ){
+        pool->affine[i] = _task_queue_create(&pool->allocator, 4);
+    }
+    pool->affine_queued = 0;
+    pool->strands_ready = NULL;
+    pool->strands_ready_tail = NULL;
+    if ( pthread_create(&pool->manager, NULL, _manager_run, pool) < 0 ) FATALERROR;
+    return pool;
+}
+
+/* immediately return */
+/* the actual thread will terminate until all previous tasks done */
+void
+threadpool_destroy(threadpool_t *pool)
+{
+    threadpool_shutdown(pool, threadpool_shutdown_drain, 0);
+}
+
+int
+threadpool_shutdown(threadpool_t *pool, threadpool_shutdown_mode_t mode, long timeout_ms)
+{
+    /* the manager frees the pool as its last act, and then its own exit is the signal */
+    pthread_t manager = pool->manager;
+    cond_lock_lock(&shutdowns_lock);
+    shutdowns++;
+    cond_lock_unlock(&shutdowns_lock);
+    manager_event_t e;
+    e.event_type = manager_event_call_die;
+    e.data.shutdown_mode = mode;
+    _inform_manager(pool, &e);
+
+    if ( timeout_ms == 0 ){
+        if ( pthread_detach(manager) < 0 ) FATALERROR;
+        return 0;
+    }
+    if ( timeout_ms < 0 ){
+        if ( pthread_join(manager, NULL) < 0 ) FATALERROR;
+        return 0;
+    }
+
+    struct timespec abstime;
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_sec += timeout_ms / 1000;
+    abstime.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if ( abstime.tv_nsec >= 1000000000 ){
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+    }
+    int res = pthread_timedjoin_np(manager, NULL, &abstime);
+    if ( res == ETIMEDOUT ){
+        if ( pthread_detach(manager) < 0 ) FATALERROR;
+        return ETIMEDOUT;
+    }
+    if ( res ) FATALERROR;
+    return 0;
+}
+
+void
+threadpool_shutdown_wait_all(void)
+{
+    cond_lock_lock(&shutdowns_lock);
+    while ( shutdowns > 0 ){
+        cond_lock_wait(&shutdowns_lock);
+    }
+    cond_lock_unlock(&shutdowns_lock);
+}
+
+static void
+_task_init(threadpool_t *pool, task_t *t, task_type_t type, void* (*routine)(void*), void *args, const task_attr_t *attr)
+{
+    t->task_type = type;
+    t->task_func = routine;
+    t->task_argu = args;
+    t->task_inline_size = 0;
+    t->task_into = NULL;
+    t->task_error = 0;
+    t->task_tag = 0;
+    t->task_worker = TASK_ANY_WORKER;
+    t->task_submitted_ns = _clock_ns(CLOCK_MONOTONIC);
+    t->task_started_ns = 0;
+    t->task_cpu_ns = 0;
+    t->task_fut  = -1;
+    t->task_token = NULL;
+    t->task_group = NULL;
+    t->task_strand = NULL;
+    t->task_fiber = NULL;
+    t->task_context = attr && attr->context ? attr->context : pool->default_context;
+    __atomic_add_fetch(&t->task_context->submitted, 1, __ATOMIC_RELAXED);
+    _group_add(&t->task_context->scope);
+    if ( !attr ) return;
+    assert( attr->tag < THREADPOOL_TAGS );
+    t->task_tag = attr->tag;
+    if ( attr->token ){
+        __atomic_add_fetch(&attr->token->refs, 1, __ATOMIC_RELAXED);
+        t->task_token = attr->token;
+    }
+    if ( attr->group ){
+        _group_add(attr->group);
+        t->task_group = attr->group;
+    }
+    if ( attr->strand ){
+        _group_add(&attr->strand->scope);
+        t->task_strand = attr->strand;
+    }
+}
+
+/* pending until whoever gets handed fut resolves it */
+static future_t
+_future_new(threadpool_t *pool)
+{
+    /* manager might be accessing a future_list_entry */
+    /* a potential realloc will destroy it */
+    cond_lock_lock(&pool->manager_inform);
+    future_t fut = _future_get_next(pool->future_list);
+    cond_lock_t *access = pool->future_list->entries[fut].fut_access;
+    cond_lock_unlock(&pool->manager_inform);
+
+    cond_lock_er_lock(access);
+    return fut;
+}
+
+void
+threadpool_goroutine(threadpool_t *pool, void (*routine)(void*), void *args)
+{
+    threadpool_goroutine_attr(pool, routine, args, NULL);
+}
+
+void
+threadpool_goroutine_attr(threadpool_t *pool, void (*routine)(void*), void *args, const task_attr_t *attr)
+{
+    manager_event_t e;
+    e.event_type = manager_event_task_addin;
+    _task_init(pool, &e.data.task, task_goroutine, (void* (*)(void*))routine, args, attr);
+    _inform_manager(pool, &e);
+}
+
+static uint64_t
+_key_hash(uint64_t key)
+{
+    /* splitmix64 finalizer, neighbouring keys spread over the workers */
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return key;
+}
+
+void
+threadpool_goroutine_on(threadpool_t *pool, size_t worker_hint, void (*routine)(void*), void *args, const task_attr_t *attr)
+{
+    manager_event_t e;
+    e.event_type = manager_event_task_addin;
+    _task_init(pool, &e.data.task, task_goroutine, (void* (*)(void*))routine, args, attr);
+    e.data.task.task_worker = worker_hint % pool->size;
+    _inform_manager(pool, &e);
+}
+
+future_t
+threadpool_gofuture_on(threadpool_t *pool, size_t worker_hint, void* (*routine)(void*), void *args, const task_attr_t *attr)
+{
+    future_t fut = _future_new(pool);
+    manager_event_t e;
+    e.event_type = manager_event_task_addin;
+    _task_init(pool, &e.data.task, task_gofuture, routine, args, attr);
+    e.data.task.task_worker = worker_hint % pool->size;
+    e.data.task.task_fut  = fut;
+    _inform_manager(pool, &e);
+    return fut;
+}
+
+void
+threadpool_goroutine_keyed(threadpool_t *pool, uint64_t key, void (*routine)(void*), void *args, const task_attr_t *attr)
+{
+    threadpool_goroutine_on(pool, _key_hash(key) % pool->size, routine, args, attr);
+}
+
+future_t
+threadpool_gofuture_keyed(threadpool_t *pool, uint64_t key, void* (*routine)(void*), void *args, const task_attr_t *attr)
+{
+    return threadpool_gofuture_on(pool, _key_hash(key) % pool->size, routine, args, attr);
+}
+
+void
+threadpool_goroutine_inline(threadpool_t *pool, void (*routine)(void*), const void *args, size_t args_size, const task_attr_t *attr)
+{
+    assert( args_size > 0 && args_size <= TASK_INLINE_ARGS );
+    manager_event_t e;
+    e.event_type = manager_event_task_addin;
+    _task_init(pool, &e.data.task, task_goroutine, (void* (*)(void*))routine, NULL, attr);
+    memcpy(e.data.task.task_inline, args, args_size);
+    e.data.task.task_inline_size = args_size;
+    _inform_manager(pool, &e);
+}
+
+future_t 
+threadpool_gofuture(threadpool_t *pool, void* (*routine)(void*), void *args)
+{
+    return threadpool_gofuture_attr(pool, routine, args, NULL);
+}
+
+future_t 
+threadpool_gofuture_attr(threadpool_t *pool, void* (*routine)(void*), void *args, const task_attr_t *attr)
+{
+    future_t fut = _future_new(pool);
+    manager_event_t e;
+    e.event_type = manager_event_task_addin;
+    _task_init(pool, &e.data.task, task_gofuture, routine, args, attr);
+    e.data.task.task_fut  = fut;
+    _inform_manager(pool, &e);
+    return fut;
+}
+
+future_t
+threadpool_gofuture_inline(threadpool_t *pool, void* (*routine)(void*), const void *args, size_t args_size, const task_attr_t *attr)
+{
+    assert( args_size > 0 && args_size <= TASK_INLINE_ARGS );
+    future_t fut = _future_new(pool);
+    manager_event_t e;
+    e.event_type = manager_event_task_addin;
+    _task_init(pool, &e.data.task, task_gofuture, routine, NULL, attr);
+    memcpy(e.data.task.task_inline, args, args_size);
+    e.data.task.task_inline_size = args_size;
+    e.data.task.task_fut  = fut;
+    _inform_manager(pool, &e);
+    return fut;
+}
+
+future_t
+threadpool_gofuture_into(threadpool_t *pool, void (*routine)(void*, void*), void *args, void *res, size_t res_size, const task_attr_t *attr)
+{
+    future_t fut = _future_new(pool);
+    if ( !res ){
+        assert( res_size <= FUTURE_RESULT_SIZE );
+        cond_lock_lock(&pool->manager_inform);
+        res = pool->future_list->entries[fut].result_slot;
+        cond_lock_unlock(&pool->manager_inform);
+    }
+    manager_event_t e;
+    e.event_type = manager_event_task_addin;
+    _task_init(pool, &e.data.task, task_gofuture, NULL, args, attr);
+    e.data.task.task_into = routine;
+    e.data.task.task_res = res;
+    e.data.task.task_fut  = fut;
+    _inform_manager(pool, &e);
+    return fut;
+}
+
+void*
+threadpool_get(threadpool_t *pool, future_t fut)
+{
+    void *res = NULL;
+    if ( threadpool_get_status(pool, fut, &res) != future_status_ok ) return NULL;
+    return res;
+}
+
+/* a slot result is copied out before the slot goes back to the stack */
+static future_status_t
+_future_get(threadpool_t *pool, future_t fut, void **value, void *out, size_t size)
+{
+    __atomic_add_fetch(&pool->getters, 1, __ATOMIC_ACQ_REL);
+    /* entries may be reallocated by a gofuture from a task, only fut_access stays put */
+    cond_lock_lock(&pool->manager_inform);
+    cond_lock_t *access = pool->future_list->entries[fut].fut_access;
+    int pending = pool->future_list->entries[fut].status == future_status_pending;
+    cond_lock_unlock(&pool->manager_inform);
+
+    /* only this pool's manager can resume it, any other wait blocks the worker */
+    threadpool_fiber_t *f = current_fiber;
+    if ( f && f->pool == pool && pending ) _fiber_suspend(f, fut);
+    cond_lock_ee_wait(access);
+    cond_lock_ee_finish(access);
+
+    /* a concurrent gofuture pops from the same stack */
+    cond_lock_lock(&pool->manager_inform);
+    future_list_entry_t *fe = &pool->future_list->entries[fut];
+    future_status_t status = fe->status;
+    if ( status == future_status_ok ){
+        if ( value ) *value = fe->value;
+        if ( out && out != fe->value ) memcpy(out, fe->value, size);
+    }else if ( status == future_status_error && value ){
+        *value = fe->value;
+    }
+    _future_put_available(pool->future_list, fut);
+    cond_lock_unlock(&pool->manager_inform);
+    __atomic_sub_fetch(&pool->getters, 1, __ATOMIC_ACQ_REL);
+    return status;
+}
+
+future_status_t
+threadpool_get_status(threadpool_t *pool, future_t fut, void **value)
+{
+    return _future_get(pool, fut, value, NULL, 0);
+}
+
+future_status_t
+threadpool_get_into(threadpool_t *pool, future_t fut, void *out, size_t size)
+{
+    return _future_get(pool, fut, NULL, out, size);
+}
+
+void
+threadpool_join(threadpool_t *pool)
+{
+    cond_lock_ee_wait(&pool->join);
+    cond_lock_unlock(&pool->join);
+}
+
+void
+threadpool_future_then(threadpool_t *pool, future_t fut, void (*routine)(void*), void *args)
+{
+    /* resolution happens under the same lock, either it sees the continuation or it is already done */
+    cond_lock_lock(&pool->manager_inform);
+    future_list_entry_t *fe = &pool->future_list->entries[fut];
+    int pending = fe->status == future_status_pending;
+    if ( pending ){
+        fe->then_routine = routine;
+        fe->then_args = args;
+    }
+    cond_lock_unlock(&pool->manager_inform);
+
+    if ( !pending ){
+        manager_event_t e;
+        e.event_type = manager_event_future_continue;
+        e.data.cont.routine = routine;
+        e.data.cont.args = args;
+        _inform_manager(pool, &e);
+    }
+}
+
+static future_t
+_io_submit(threadpool_t *pool, io_op_t type, int fd, void *buf, size_t len, off_t off)
+{
+    io_engine_t *io = _io_engine(pool);
+    threadpool_io_op_t *op = (threadpool_io_op_t*) _pool_malloc(&pool->allocator, sizeof(threadpool_io_op_t));
+    op->req.op = type;
+    op->req.fd = fd;
+    op->req.buf = buf;
+    op->req.len = len;
+    op->req.off = off;
+    op->req.done = _io_done;
+    op->pool = pool;
+    op->fut = _future_new(pool);
+    /* op may be gone as soon as this returns */
+    future_t fut = op->fut;
+    io_engine_submit(io, &op->req);
+    return fut;
+}
+
+future_t
+threadpool_read(threadpool_t *pool, int fd, void *buf, size_t len, off_t off)
+{
+    return _io_submit(pool, io_op_read, fd, buf, len, off);
+}
+
+future_t
+threadpool_write(threadpool_t *pool, int fd, const void *buf, size_t len, off_t off)
+{
+    return _io_submit(pool, io_op_write, fd, (void*) buf, len, off);
+}
+
+future_t
+threadpool_fsync(threadpool_t *pool, int fd)
+{
+    return _io_submit(pool, io_op_fsync, fd, NULL, 0, 0);
+}
+
+static threadpool_timer_t*
+_timer_schedule(threadpool_t *pool, long delay_ms, long period_ms, void (*routine)(void*), void *args)
+{
+    threadpool_timer_t *timer = (threadpool_timer_t*) _pool_malloc(&pool->allocator, sizeof(threadpool_timer_t));
+    _life_acquire(pool->life);
+    timer->life = pool->life;
+    timer->routine = routine;
+    timer->args = args;
+    timer->period = period_ms > 0 ? (uint64_t) period_ms : 0;
+    timer->armed = 0;
+    timer->cancelled = 0;
+    /* the caller's, and the add event's which then goes to the wheel */
+    timer->refs = 2;
+    timer->node.expires = _clock_ms() + (delay_ms > 0 ? (uint64_t) delay_ms : 0);
+
+    manager_event_t e;
+    e.event_type = manager_event_timer_add;
+    e.data.timer = timer;
+    _inform_manager(pool, &e);
+    return timer;
+}
+
+threadpool_timer_t*
+threadpool_schedule_after(threadpool_t *pool, long delay_ms, void (*routine)(void*), void *args)
+{
+    return _timer_schedule(pool, delay_ms, 0, routine, args);
+}
+
+threadpool_timer_t*
+threadpool_schedule_every(threadpool_t *pool, long period_ms, void (*routine)(void*), void *args)
+{
+    if ( period_ms <= 0 ) period_ms = 1;
+    return _timer_schedule(pool, period_ms, period_ms, routine, args);
+}
+
+void
+threadpool_timer_cancel(threadpool_timer_t *timer)
+{
+    /* only the first cancel has to reach the wheel */
+    if ( !__atomic_exchange_n(&timer->cancelled, 1, __ATOMIC_ACQ_REL) ){
+        __atomic_add_fetch(&timer->refs, 1, __ATOMIC_RELAXED);
+        manager_event_t e;
+        e.event_type = manager_event_timer_cancel;
+        e.data.timer = timer;
+        /* the wheel went with the pool */
+        if ( !_life_inform(timer->life, &e) ) threadpool_timer_release(timer);
+    }
+    threadpool_timer_release(timer);
+}
+
+void
+threadpool_timer_release(threadpool_timer_t *timer)
+{
+    if ( __atomic_sub_fetch(&timer->refs, 1, __ATOMIC_ACQ_REL) == 0 ){
+        threadpool_life_t *life = timer->life;
+        _pool_free(&life->allocator, timer);
+        _life_release(life);
+    }
+}
+
+threadpool_token_t*
+threadpool_token_create(threadpool_t *pool)
+{
+    threadpool_token_t *token = (threadpool_token_t*) _pool_malloc(&pool->allocator, sizeof(threadpool_token_t));
+    _life_acquire(pool->life);
+    token->life = pool->life;
+    token->cancelled = 0;
+    token->refs = 1;
+    return token;
+}
+
+void
+threadpool_token_cancel(threadpool_token_t *token)
+{
+    /* only the first cancel has to purge the queue */
+    if ( __atomic_exchange_n(&token->cancelled, 1, __ATOMIC_ACQ_REL) ) return;
+
+    __atomic_add_fetch(&token->refs, 1, __ATOMIC_RELAXED);
+    manager_event_t e;
+    e.event_type = manager_event_token_cancel;
+    e.data.token = token;
+    /* nothing left to purge in a pool that is gone */
+    if ( !_life_inform(token->life, &e) ) threadpool_token_release(token);
+}
+
+int
+threadpool_token_cancelled(const threadpool_token_t *token)
+{
+    return __atomic_load_n(&token->cancelled, __ATOMIC_ACQUIRE);
+}
+
+void
+threadpool_token_release(threadpool_token_t *token)
+{
+    if ( __atomic_sub_fetch(&token->refs, 1, __ATOMIC_ACQ_REL) == 0 ){
+        threadpool_life_t *life = token->life;
+        _pool_free(&life->allocator, token);
+        _life_release(life);
+    }
+}
+
+threadpool_token_t*
+threadpool_current_token(void)
+{
+    return current_token;
+}
+
+void
+threadpool_fail(int code)
+{
+    /* a fiber may have moved to another worker since current_task was set there */
+    task_t *t = current_fiber ? &current_fiber->task : current_task;
+    if ( t ) t->task_error = code;
+}
+
+threadpool_group_t*
+threadpool_group_create(threadpool_t *pool)
+{
+    threadpool_group_t *group = (threadpool_group_t*) _pool_malloc(&pool->allocator, sizeof(threadpool_group_t));
+    _group_init(group, &pool->allocator);
+    return group;
+}
+
+void
+threadpool_group_wait(threadpool_group_t *group)
+{
+    cond_lock_lock(&group->idle);
+    while ( __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0 ){
+        cond_lock_wait(&group->idle);
+    }
+    cond_lock_unlock(&group->idle);
+}
+
+size_t
+threadpool_group_pending(threadpool_group_t *group)
+{
+    return __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE);
+}
+
+void
+threadpool_group_destroy(threadpool_group_t *group)
+{
+    assert( threadpool_group_pending(group) == 0 );
+    cond_lock_destroy(&group->idle);
+    _pool_free(&group->allocator, group);
+}
+
+threadpool_context_t*
+threadpool_context_create(threadpool_t *pool, unsigned weight)
+{
+    threadpool_context_t *ctx = _context_create(pool, weight);
+
+    /* manager walks the array while dispatching */
+    cond_lock_lock(&pool->manager_inform);
+    if ( pool->contexts_cnt == pool->contexts_size ){
+        pool->contexts_size *= 2;
+        pool->contexts = (threadpool_context_t**) _pool_realloc(&pool->allocator, pool->contexts,
+                sizeof(threadpool_context_t*) * pool->contexts_size);
+    }
+    pool->contexts[ pool->contexts_cnt++ ] = ctx;
+    cond_lock_unlock(&pool->manager_inform);
+    return ctx;
+}
+
+void
+threadpool_context_join(threadpool_context_t *ctx)
+{
+    threadpool_group_wait(&ctx->scope);
+}
+
+void
+threadpool_context_stats(threadpool_context_t *ctx, threadpool_context_stats_t *stats)
+{
+    stats->submitted = __atomic_load_n(&ctx->submitted, __ATOMIC_RELAXED);
+    stats->completed = __atomic_load_n(&ctx->completed, __ATOMIC_RELAXED);
+    stats->cancelled = __atomic_load_n(&ctx->cancelled, __ATOMIC_RELAXED);
+    stats->pending = threadpool_group_pending(&ctx->scope);
+}
+
+void
+threadpool_tag_stats(threadpool_t *pool, unsigned tag, threadpool_tag_stats_t *stats)
+{
+    assert( tag < THREADPOOL_TAGS );
+    threadpool_tag_stats_t *st = &pool->tags[tag];
+    stats->tasks = __atomic_load_n(&st->tasks, __ATOMIC_RELAXED);
+    stats->cpu_ns = __atomic_load_n(&st->cpu_ns, __ATOMIC_RELAXED);
+    stats->wall_ns = __atomic_load_n(&st->wall_ns, __ATOMIC_RELAXED);
+    stats->wait_ns = __atomic_load_n(&st->wait_ns, __ATOMIC_RELAXED);
+}
+
+void
+threadpool_tag_limit(threadpool_t *pool, unsigned tag, const threadpool_tag_limits_t *limits)
+{
+    assert( tag < THREADPOOL_TAGS );
+    manager_event_t e;
+    e.event_type = manager_event_tag_limit;
+    e.data.tag_limit.tag = tag;
+    if ( limits ) e.data.tag_limit.limits = *limits;
+    else memset(&e.data.tag_limit.limits, 0, sizeof(e.data.tag_limit.limits));
+    _inform_manager(pool, &e);
+}
+
+threadpool_trace_t*
+threadpool_trace_create(const threadpool_allocator_t *allocator, uint64_t seed)
+{
+    threadpool_allocator_t al = { NULL, NULL, NULL, NULL };
+    if ( allocator ) al = *allocator;
+    else memcheck_init();
+    threadpool_trace_t *tr = (threadpool_trace_t*) _pool_malloc(&al, sizeof(threadpool_trace_t));
+    tr->allocator = al;
+    tr->entries = NULL;
+    tr->count = 0;
+    tr->size = 0;
+    tr->pos = 0;
+    tr->diverged = 0;
+    tr->seed = seed ? seed : 0x9e3779b97f4a7c15ull;
+    return tr;
+}
+
+int
+threadpool_trace_save(const threadpool_trace_t *trace, FILE *f)
+{
+    for ( size_t i = 0; i < trace->count; i++ ){
+        const threadpool_trace_entry_t *en = &trace->entries[i];
+        if ( fprintf(f, "%llu %u %u\n", (unsigned long long) en->seq, en->worker, en->resume) < 0 ) return -1;
+    }
+    return fflush(f) == 0 ? 0 : -1;
+}
+
+threadpool_trace_t*
+threadpool_trace_load(const threadpool_allocator_t *allocator, FILE *f)
+{
+    threadpool_trace_t *tr = threadpool_trace_create(allocator, 0);
+    unsigned long long seq;
+    unsigned worker, resume;
+    int res;
+    while ( (res = fscanf(f, "%llu %u %u", &seq, &worker, &resume)) == 3 ){
+        task_t t;
+        t.task_seq = seq;
+        t.task_type = resume ? task_resume : task_goroutine;
+        _trace_append(tr, &t, worker);
+    }
+    if ( res != EOF || ferror(f) ){
+        threadpool_trace_destroy(tr);
+        return NULL;
+    }
+    return tr;
+}
+
+void
+threadpool_trace_destroy(threadpool_trace_t *trace)
+{
+    if ( trace->entries ) _pool_free(&trace->allocator, trace->entries);
+    _pool_free(&trace->allocator, trace);
+}
+
+void
+threadpool_trace_start(threadpool_t *pool)
+{
+    manager_event_t e;
+    e.event_type = manager_event_trace_start;
+    _inform_manager(pool, &e);
+}
+
+void
+threadpool_context_destroy(threadpool_context_t *ctx)
+{
+    threadpool_t *pool = ctx->pool;
+    assert( ctx != pool->default_context );
+    assert( threadpool_group_pending(&ctx->scope) == 0 );
+
+    cond_lock_lock(&pool->manager_inform);
+    for ( size_t i = 1; i < pool->contexts_cnt; i++ ){
+        if ( pool->contexts[i] != ctx ) continue;
+        memmove(&pool->contexts[i], &pool->contexts[i + 1], sizeof(threadpool_context_t*) * (pool->contexts_cnt - i - 1));
+        pool->contexts_cnt--;
+        break;
+    }
+    cond_lock_unlock(&pool->manager_inform);
+    _context_destroy(ctx);
+}
+
+threadpool_strand_t*
+threadpool_strand_create(threadpool_t *pool)
+{
+    threadpool_strand_t *st = (threadpool_strand_t*) _pool_malloc(&pool->allocator, sizeof(threadpool_strand_t));
+    st->allocator = pool->allocator;
+    st->busy = 0;
+    /* its own allocator, the strand may outlive the pool */
+    st->waiting = _task_queue_create(&st->allocator, 4);
+    st->next_ready = NULL;
+    _group_init(&st->scope, &pool->allocator);
+    return st;
+}
+
+void
+threadpool_strand_join(threadpool_strand_t *strand)
+{
+    threadpool_group_wait(&strand->scope);
+}
+
+void
+threadpool_strand_destroy(threadpool_strand_t *strand)
+{
+    assert( threadpool_group_pending(&strand->scope) == 0 );
+    _task_queue_destroy(strand->waiting);
+    cond_lock_destroy(&strand->scope.idle);
+    _pool_free(&strand->allocator, strand);
+}
+
+threadpool_cset_t*
+threadpool_cset_create(threadpool_t *pool)
+{
+    threadpool_cset_t *cset = (threadpool_cset_t*) _pool_malloc(&pool->allocator, sizeof(threadpool_cset_t));
+    cset->pool = pool;
+    cset->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( cset->efd < 0 ) FATALERROR;
+    cond_lock_init(&cset->lock);
+    cset->ready = NULL;
+    cset->ready_cnt = 0;
+    cset->ready_size = 0;
+    cset->members = 0;
+    return cset;
+}
+
+int
+threadpool_cset_fd(threadpool_cset_t *cset)
+{
+    return cset->efd;
+}
+
+void
+threadpool_cset_add(threadpool_cset_t *cset, future_t fut)
+{
+    threadpool_t *pool = cset->pool;
+    __atomic_add_fetch(&cset->members, 1, __ATOMIC_RELAXED);
+
+    /* resolution happens under the same lock, either it sees the set or the set sees it resolved */
+    cond_lock_lock(&pool->manager_inform);
+    future_list_entry_t *fe = &pool->future_list->entries[fut];
+    if ( fe->status == future_status_pending ){
+        fe->cset = cset;
+    }else{
+        _cset_push(cset, fut);
+    }
+    cond_lock_unlock(&pool->manager_inform);
+}
+
+size_t
+threadpool_cset_drain(threadpool_cset_t *cset, future_t *futs, size_t max)
+{
+    /* clear first, a push racing with the rest makes it readable again */
+    uint64_t cnt;
+    if ( read(cset->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN ) FATALERROR;
+
+    cond_lock_lock(&cset->lock);
+    size_t n = cset->ready_cnt < max ? cset->ready_cnt : max;
+    memcpy(futs, cset->ready, sizeof(future_t) * n);
+    memmove(cset->ready, cset->ready + n, sizeof(future_t) * (cset->ready_cnt - n));
+    cset->ready_cnt -= n;
+    size_t left = cset->ready_cnt;
+    cond_lock_unlock(&cset->lock);
+
+    /* more than max were ready, stay readable */
+    uint64_t one = 1;
+    if ( left > 0 && write(cset->efd, &one, sizeof(one)) < 0 && errno != EAGAIN ) FATALERROR;
+    __atomic_sub_fetch(&cset->members, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+void
+threadpool_cset_destroy(threadpool_cset_t *cset)
+{
+    assert( __atomic_load_n(&cset->members, __ATOMIC_RELAXED) == 0 );
+    close(cset->efd);
+    cond_lock_destroy(&cset->lock);
+    _pool_free(&cset->pool->allocator, cset->ready);
+    _pool_free(&cset->pool->allocator, cset);
 }
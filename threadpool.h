@@ -2,20 +2,117 @@
 #define _THREADPOOL_H_
 
 #include "lock.h"
+#include "fiber.h"
+#include "ioengine.h"
+#include "timerwheel.h"
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef int      future_t;
 typedef size_t   index_t;
 
+/* allocator utilities */
+
+/* every internal allocation of a pool goes through these hooks */
+typedef struct threadpool_allocator_s {
+    void*               (*allocator_malloc)(void *ctx, size_t sz);
+    void*               (*allocator_realloc)(void *ctx, void *ptr, size_t sz);
+    void                (*allocator_free)(void *ctx, void *ptr);
+    void*               allocator_ctx;
+} threadpool_allocator_t;
+
+typedef enum {
+    /* io_uring when the kernel allows it, else blocking io threads */
+    threadpool_io_auto,
+    threadpool_io_threads,
+} threadpool_io_backend_t;
+
+/* dispatch traces, for chasing ordering bugs and for noise free comparisons */
+typedef enum {
+    threadpool_trace_off,
+    /* appends every dispatch to the trace */
+    threadpool_trace_record,
+    /* dispatches in the order of the trace, to the same workers */
+    threadpool_trace_replay,
+    /* picks among the ready tasks by the trace's seed, and records like record */
+    /* one worker only, so that no completion timing gets in and the schedule is a function of the seed */
+    threadpool_trace_simulate,
+} threadpool_trace_mode_t;
+
+typedef struct threadpool_trace_entry_s {
+    /* submission number of the task, in the order the manager got them */
+    uint64_t            seq;
+    uint32_t            worker;
+    /* non zero for a suspended fiber going on */
+    uint32_t            resume;
+} threadpool_trace_entry_t;
+
+typedef struct threadpool_trace_s {
+    threadpool_allocator_t allocator;
+    threadpool_trace_entry_t *entries;
+    size_t              count;
+    size_t              size;
+    /* replay: the next entry to follow */
+    size_t              pos;
+    /* replay: the run went elsewhere, the rest was dispatched in plain order */
+    int                 diverged;
+    /* simulate: xorshift state, never 0 */
+    uint64_t            seed;
+} threadpool_trace_t;
+
+typedef struct threadpool_config_s {
+    /* NULL for the default memcheck allocator */
+    const threadpool_allocator_t *allocator;
+    /* non zero runs every task on a pooled fiber of this stack size, */
+    /* and threadpool_get on a future of the same pool suspends the fiber instead of the worker */
+    size_t              fiber_stack_size;
+    threadpool_io_backend_t io_backend;
+    /* trace must outlive the pool */
+    threadpool_trace_mode_t trace_mode;
+    threadpool_trace_t  *trace;
+} threadpool_config_t;
+
 /* future utilities */
 
+typedef enum {
+    future_status_pending,
+    future_status_ok,
+    /* the task never ran */
+    future_status_cancelled,
+    /* the task called threadpool_fail, the value is its code */
+    future_status_error,
+} future_status_t;
+
+struct threadpool_fiber_s;
+struct threadpool_cset_s;
+
+/* bytes of result a future can hold itself */
+#define FUTURE_RESULT_SIZE  64
+
 typedef struct future_list_entry_s {
     /* subject to realloc */
     cond_lock_t         *fut_access;
+    /* FUTURE_RESULT_SIZE bytes, allocated with the entry so it stays put too */
+    void*               result_slot;
     void*               value;
+    future_status_t     status;
+    /* suspended on this future, resumed by the manager on resolve */
+    struct threadpool_fiber_s *waiter;
+    /* told on resolve */
+    struct threadpool_cset_s *cset;
+    /* submitted as a task on resolve */
+    void                (*then_routine)(void*);
+    void*               then_args;
 } future_list_entry_t;
 
 typedef struct future_list_s{
+    const threadpool_allocator_t *allocator;
+
     /* both entries size and available stack size */
     size_t              size;
 
@@ -27,37 +124,259 @@ typedef struct future_list_s{
     size_t              available_stack_pos;
 } future_list_t;
 
+/* completion set utilities */
+
+typedef struct threadpool_cset_s {
+    struct threadpool_s *pool;
+    /* eventfd, readable while ready is not empty */
+    int                 efd;
+    cond_lock_t         lock;
+    /* resolved and not yet drained, oldest first */
+    future_t            *ready;
+    size_t              ready_cnt;
+    size_t              ready_size;
+    /* added and not yet drained */
+    size_t              members;
+} threadpool_cset_t;
+
+/* cancellation utilities */
+
+/* what tokens and timers reach the pool through, they may outlive it */
+typedef struct threadpool_life_s {
+    /* copied, freed after the pool */
+    threadpool_allocator_t allocator;
+    /* held while informing, so the pool cannot go away in between */
+    cond_lock_t         lock;
+    /* NULL once the pool is torn down */
+    struct threadpool_s *pool;
+    /* the pool, plus every token and timer */
+    size_t              refs;
+} threadpool_life_t;
+
+typedef struct threadpool_token_s {
+    threadpool_life_t   *life;
+    int                 cancelled;
+    /* creator, plus every task and pending event holding it */
+    size_t              refs;
+} threadpool_token_t;
+
+/* timer utilities */
+
+typedef struct threadpool_timer_s {
+    /* first, the wheel hands back nodes */
+    timer_node_t        node;
+    threadpool_life_t   *life;
+    void                (*routine)(void*);
+    void*               args;
+    /* 0 for one shot */
+    uint64_t            period;
+    /* in the wheel, only touched by manager */
+    int                 armed;
+    int                 cancelled;
+    /* creator, the wheel while armed, and every pending event */
+    size_t              refs;
+} threadpool_timer_t;
+
+/* group utilities */
+
+typedef struct threadpool_group_s {
+    threadpool_allocator_t allocator;
+    /* submitted but not yet finished or cancelled */
+    size_t              pending;
+    cond_lock_t         idle;
+} threadpool_group_t;
+
 /* task utilities */
 
+struct threadpool_context_s;
+struct threadpool_strand_s;
+
+/* accounting tags, untagged tasks count as tag 0 */
+#define THREADPOOL_TAGS     64
+
+/* optional per submission attributes, zero means default */
+typedef struct task_attr_s {
+    threadpool_token_t  *token;
+    threadpool_group_t  *group;
+    /* NULL for the pool's own context */
+    struct threadpool_context_s *context;
+    /* below THREADPOOL_TAGS, e.g. a tenant or request class */
+    unsigned            tag;
+    /* runs after the strand's earlier tasks and never alongside them */
+    struct threadpool_strand_s *strand;
+} task_attr_t;
+
+/* totals over finished tasks, in nanoseconds */
+typedef struct threadpool_tag_stats_s {
+    size_t              tasks;
+    /* thread cpu time of the workers running them */
+    uint64_t            cpu_ns;
+    /* first run to finish, suspensions included */
+    uint64_t            wall_ns;
+    /* submission to first run */
+    uint64_t            wait_ns;
+} threadpool_tag_stats_t;
+
+/* dispatch limits of a tag, zero means unlimited */
+typedef struct threadpool_tag_limits_s {
+    /* tasks of the tag running at once, suspended fibers included */
+    unsigned            max_running;
+    /* tasks started per second, up to burst back to back */
+    unsigned            rate;
+    unsigned            burst;
+} threadpool_tag_limits_t;
+
 typedef enum {
     task_goroutine,
     task_gofuture,
     task_die,
+    /* continue a suspended fiber */
+    task_resume,
+    /* run the worker's batch */
+    task_batch,
 } task_type_t;
 
+#define TASK_ANY_WORKER     ((index_t) -1)
+
+/* bytes of argument a task can carry by value */
+#define TASK_INLINE_ARGS    64
+
 typedef struct task_s{
     task_type_t     task_type;
     void*           (*task_func)(void*);
     void*           task_argu;
+    /* non zero: the routine gets the copy of task_inline it runs from, not task_argu */
+    size_t          task_inline_size;
+    unsigned char   task_inline[TASK_INLINE_ARGS] __attribute__((aligned(16)));
+    /* non NULL: runs instead of task_func, writes its result to task_res */
+    void            (*task_into)(void*, void*);
+    void*           task_res;
+    /* set by threadpool_fail while it runs */
+    int             task_error;
+    unsigned        task_tag;
+    /* preferred worker, TASK_ANY_WORKER for none */
+    index_t         task_worker;
+    uint64_t        task_submitted_ns;
+    /* 0 until it first runs */
+    uint64_t        task_started_ns;
+    /* summed over every stretch it ran, as a fiber possibly on several workers */
+    uint64_t        task_cpu_ns;
+    /* numbered under manager_inform, so in the order the manager gets them */
+    uint64_t        task_seq;
     future_t        task_fut;
+    threadpool_token_t *task_token;
+    threadpool_group_t *task_group;
+    struct threadpool_context_s *task_context;
+    struct threadpool_strand_s *task_strand;
+    /* fiber mode only, the fiber the task runs on */
+    struct threadpool_fiber_s *task_fiber;
 } task_t;
 
 typedef struct task_queue_s {
+    const threadpool_allocator_t *allocator;
     size_t size;
     task_t *tasks;
     index_t head;
     index_t tail;
 } task_queue_t;
 
+/* by manager */
+typedef struct tag_state_s {
+    threadpool_tag_limits_t limits;
+    unsigned            running;
+    /* token bucket, refilled lazily */
+    double              tokens;
+    uint64_t            refilled_ms;
+    /* over its limits, in submission order; created on first use */
+    task_queue_t        *held;
+} tag_state_t;
+
+/* strands, serial executors on a shared pool */
+
+typedef struct threadpool_strand_s {
+    threadpool_allocator_t allocator;
+    /* by manager: one of its tasks is queued, running or suspended, the rest wait here */
+    int                 busy;
+    task_queue_t        *waiting;
+    /* done with its last task while more waited, hands the next one over on the next dispatch */
+    struct threadpool_strand_s *next_ready;
+    /* join scope */
+    threadpool_group_t  scope;
+} threadpool_strand_t;
+
+/* executor contexts, separate queues sharing the workers of one pool */
+
+typedef struct threadpool_context_s {
+    struct threadpool_s *pool;
+    task_queue_t        *task_queue;
+    /* share of the workers relative to the other busy contexts */
+    unsigned            weight;
+    /* stride scheduling, the busy context with the lowest pass goes next */
+    uint64_t            pass;
+    /* join scope */
+    threadpool_group_t  scope;
+    size_t              submitted;
+    size_t              completed;
+    size_t              cancelled;
+} threadpool_context_t;
+
+typedef struct threadpool_context_stats_s {
+    size_t              submitted;
+    size_t              completed;
+    size_t              cancelled;
+    /* queued or running */
+    size_t              pending;
+} threadpool_context_stats_t;
+
+typedef enum {
+    /* finish every queued task first */
+    threadpool_shutdown_drain,
+    /* discard tasks not started yet, their futures get cancelled */
+    threadpool_shutdown_cancel,
+} threadpool_shutdown_mode_t;
+
+/* fiber utilities */
+
+typedef enum {
+    fiber_state_running,
+    fiber_state_suspended,
+    fiber_state_done,
+} fiber_state_t;
+
+typedef struct threadpool_fiber_s {
+    fiber_t             fiber;
+    struct threadpool_s *pool;
+    /* the task it was started for, kept across suspensions */
+    task_t              task;
+    void*               res;
+    fiber_state_t       state;
+    future_t            wait_fut;
+    /* where it runs right now, it may move between workers */
+    struct worker_s     *worker;
+    struct threadpool_fiber_s *next;
+} threadpool_fiber_t;
+
 /* event_queue utilities */
 
 typedef enum {
     /* event from user */
     manager_event_call_die,
     manager_event_task_addin,
+    manager_event_token_cancel,
+    manager_event_timer_add,
+    manager_event_timer_cancel,
+    manager_event_tag_limit,
+    manager_event_trace_start,
 
     /* event from worker */
     manager_event_worker_done,
+    manager_event_fiber_suspend,
+    manager_event_worker_progress,
+
+    /* event from io completion */
+    manager_event_fiber_resume,
+    /* or from threadpool_future_then on a resolved future */
+    manager_event_future_continue,
 } manager_event_type_t;
 
 typedef struct manager_event_s {
@@ -65,22 +384,55 @@ typedef struct manager_event_s {
     union {
         task_t  task;
         index_t worker_ind;
+        threadpool_shutdown_mode_t shutdown_mode;
+        threadpool_token_t *token;
+        struct threadpool_fiber_s *fiber;
+        threadpool_timer_t *timer;
+        struct {
+            unsigned tag;
+            threadpool_tag_limits_t limits;
+        } tag_limit;
+        struct {
+            void (*routine)(void*);
+            void *args;
+        } cont;
     } data;
 } manager_event_t;
 
 typedef struct event_queue_s {
+    const threadpool_allocator_t *allocator;
     size_t size;
     manager_event_t *events;
     index_t head;
     index_t tail;
 } event_queue_t;
 
+/* a free worker takes from another's affinity queue once that one is this long and its owner busy */
+#define WORKER_AFFINITY_STEAL   4
+
+/* tasks a worker may be handed at once while the queues are backed up */
+#define WORKER_BATCH        16
+/* a finished task of a batch that nobody can wait on is reported no later than this after the next one finishes, */
+/* any other right away */
+#define WORKER_BATCH_FLUSH_NS   50000
+
 typedef struct worker_s {
     pthread_t           worker;
     cond_lock_t         worker_wakeup;
 
     task_t              task;
     void*               worker_task_res;
+    /* fiber mode, where fibers switch back to */
+    ucontext_t          sched;
+
+    /* filled by manager, run in order by the worker with no round trip in between */
+    task_t              batch[WORKER_BATCH];
+    void*               batch_res[WORKER_BATCH];
+    size_t              batch_cnt;
+    /* finished so far, published by the worker */
+    size_t              batch_done;
+    /* completions the manager has handled */
+    size_t              batch_reported;
 } worker_t;
 
 typedef enum {
@@ -89,33 +441,235 @@ typedef enum {
 } threadpool_state_t;
 
 typedef struct threadpool_s {
+    threadpool_allocator_t allocator;
+    threadpool_life_t   *life;
+
     pthread_t           manager;
     threadpool_state_t  state;
+    /* how it is dying, once it is */
+    threadpool_shutdown_mode_t shutdown_mode;
     cond_lock_t         manager_inform;
     cond_lock_t         join;
 
     event_queue_t       *event_queue;
-    task_queue_t        *task_queue;
     future_list_t       *future_list;
 
+    /* contexts[0] is the pool's own, the array is guarded by manager_inform */
+    threadpool_context_t **contexts;
+    size_t              contexts_cnt;
+    size_t              contexts_size;
+    /* contexts[0] as well, read by submitters without the lock, so never through the array */
+    threadpool_context_t *default_context;
+    /* pass of the last dispatch, where a context waking up starts */
+    uint64_t            vtime;
+
     size_t              size;
     worker_t            *workers;
     index_t             *worker_available_stack;
     size_t              pos;
+
+    /* threads inside threadpool_get, teardown waits for them to leave */
+    size_t              getters;
+
+    /* fiber mode, 0 if off */
+    size_t              fiber_stack_size;
+    /* idle fibers, and resumed ones that go before any new task */
+    threadpool_fiber_t  *fibers_free;
+    task_queue_t        *resume_queue;
+    size_t              fibers_suspended;
+
+    /* started by the first io call */
+    threadpool_io_backend_t io_backend;
+    io_engine_t         *io;
+
+    /* delayed and periodic tasks, driven by manager */
+    timer_wheel_t       timers;
+
+    /* added to by workers */
+    threadpool_tag_stats_t tags[THREADPOOL_TAGS];
+    /* by manager */
+    tag_state_t         tag_states[THREADPOOL_TAGS];
+    /* tags with any limit, none means no checks at all */
+    size_t              tags_limited;
+    size_t              tags_held;
+    /* where the next look for a held task starts, no tag goes first forever */
+    unsigned            tags_cursor;
+    /* a held task gets a token by then, 0 if none waits for one */
+    uint64_t            tags_wakeup;
+
+    /* dispatch trace, by manager */
+    threadpool_trace_mode_t trace_mode;
+    threadpool_trace_t  *trace;
+    int                 trace_started;
+    /* replay and simulate choose among everything ready at once */
+    task_queue_t        *trace_ready;
+    /* next submission number, under manager_inform */
+    uint64_t            task_seq;
+
+    /* one per worker, tasks that asked for it; by manager */
+    task_queue_t        **affine;
+    size_t              affine_queued;
+
+    /* strands whose next task is due, by manager */
+    threadpool_strand_t *strands_ready;
+    threadpool_strand_t *strands_ready_tail;
 } threadpool_t;
 
+/* io utilities */
+
+typedef struct threadpool_io_op_s {
+    io_request_t        req;
+    threadpool_t        *pool;
+    future_t            fut;
+} threadpool_io_op_t;
+
 /* create and destroy */
 threadpool_t *threadpool_create(size_t sz);
+/* config may be NULL; returns NULL if the allocator hooks are incomplete, or sz is not 1 in simulate mode */
+threadpool_t *threadpool_create_ex(size_t sz, const threadpool_config_t *config);
+/* same as threadpool_shutdown(pool, threadpool_shutdown_drain, 0) */
 void threadpool_destroy(threadpool_t *pool);
+/* timeout_ms < 0 blocks until every thread of the pool is gone, 0 returns immediately */
+/* returns 0, or ETIMEDOUT if the pool is still tearing itself down in the background */
+int threadpool_shutdown(threadpool_t *pool, threadpool_shutdown_mode_t mode, long timeout_ms);
+/* block until every pool shut down so far has freed all it holds, those left in the background included */
+void threadpool_shutdown_wait_all(void);
 
 /* run routine */
 void threadpool_goroutine(threadpool_t *pool, void (*routine)(void*), void *args);
 
+void threadpool_goroutine_attr(threadpool_t *pool, void (*routine)(void*), void *args, const task_attr_t *attr);
+
+/* args_size bytes at args, at most TASK_INLINE_ARGS, travel inside the task itself */
+/* routine gets a pointer to that copy, valid while it runs; no context to malloc and free */
+void threadpool_goroutine_inline(threadpool_t *pool, void (*routine)(void*), const void *args, size_t args_size, const task_attr_t *attr);
+
+/* affinity hints, they go ahead of the pool's contexts on their worker but still count against their context's share */
+/* and their tag's limits; one held by its tag loses the hint */
+/* runs on worker worker_hint % size, or on a free one once that worker falls WORKER_AFFINITY_STEAL behind */
+void threadpool_goroutine_on(threadpool_t *pool, size_t worker_hint, void (*routine)(void*), void *args, const task_attr_t *attr);
+future_t threadpool_gofuture_on(threadpool_t *pool, size_t worker_hint, void* (*routine)(void*), void *args, const task_attr_t *attr);
+/* the same key always hints the same worker */
+void threadpool_goroutine_keyed(threadpool_t *pool, uint64_t key, void (*routine)(void*), void *args, const task_attr_t *attr);
+future_t threadpool_gofuture_keyed(threadpool_t *pool, uint64_t key, void* (*routine)(void*), void *args, const task_attr_t *attr);
+
 /* compute future result */
 future_t threadpool_gofuture(threadpool_t *pool, void* (*routine)(void*), void *args);
+future_t threadpool_gofuture_attr(threadpool_t *pool, void* (*routine)(void*), void *args, const task_attr_t *attr);
+future_t threadpool_gofuture_inline(threadpool_t *pool, void* (*routine)(void*), const void *args, size_t args_size, const task_attr_t *attr);
+/* routine writes its result straight into res, nothing to malloc in the task and free in the caller */
+/* res NULL uses the future's own slot, res_size at most FUTURE_RESULT_SIZE, read it with threadpool_get_into */
+future_t threadpool_gofuture_into(threadpool_t *pool, void (*routine)(void *args, void *res), void *args, void *res, size_t res_size, const task_attr_t *attr);
+/* NULL if the future was cancelled or failed */
 void *threadpool_get(threadpool_t *pool, future_t fut);
+/* same as threadpool_get, value is set for future_status_ok, and for future_status_error to the code as intptr_t */
+future_status_t threadpool_get_status(threadpool_t *pool, future_t fut, void **value);
+/* for threadpool_gofuture_into, copies size bytes of the result to out unless out is NULL */
+future_status_t threadpool_get_into(threadpool_t *pool, future_t fut, void *out, size_t size);
+/* from within a task, its future resolves to future_status_error with code once it returns */
+/* code must not be 0, the last call wins; no effect outside a task or for a goroutine */
+void threadpool_fail(int code);
 
 /* block until all tasks are finished */
 void threadpool_join(threadpool_t *pool);
 
+/* routine runs as a task once fut is resolved, ahead of queued tasks; one per future */
+/* fut still has to be got, which then returns immediately */
+void threadpool_future_then(threadpool_t *pool, future_t fut, void (*routine)(void*), void *args);
+
+/* async file io, completions resolve the future straight from the io thread */
+/* the value is the syscall result cast to intptr_t, or -errno */
+/* the buffer must stay valid until the future is got */
+future_t threadpool_read(threadpool_t *pool, int fd, void *buf, size_t len, off_t off);
+future_t threadpool_write(threadpool_t *pool, int fd, const void *buf, size_t len, off_t off);
+future_t threadpool_fsync(threadpool_t *pool, int fd);
+
+/* delayed and periodic tasks, handed to the normal dispatch when due */
+/* the handle is the caller's until threadpool_timer_cancel or threadpool_timer_release */
+/* pending timers are dropped at shutdown, the handle may still be cancelled or released after it */
+threadpool_timer_t *threadpool_schedule_after(threadpool_t *pool, long delay_ms, void (*routine)(void*), void *args);
+/* first run one period from now */
+threadpool_timer_t *threadpool_schedule_every(threadpool_t *pool, long period_ms, void (*routine)(void*), void *args);
+/* runs already dispatched are not recalled; releases the handle */
+void threadpool_timer_cancel(threadpool_timer_t *timer);
+void threadpool_timer_release(threadpool_timer_t *timer);
+
+/* completion sets, for event loops that must not block in threadpool_get */
+threadpool_cset_t *threadpool_cset_create(threadpool_t *pool);
+/* poll it for EPOLLIN; the set owns it */
+int threadpool_cset_fd(threadpool_cset_t *cset);
+/* fut may already be resolved, it is then ready right away */
+void threadpool_cset_add(threadpool_cset_t *cset, future_t fut);
+/* never blocks, returns how many ready futures were moved to futs */
+/* a drained future still has to be got, which then returns immediately */
+size_t threadpool_cset_drain(threadpool_cset_t *cset, future_t *futs, size_t max);
+/* every added future must have been drained */
+void threadpool_cset_destroy(threadpool_cset_t *cset);
+
+/* cancellation tokens */
+/* queued tasks of a cancelled token never run and their futures get cancelled */
+/* running tasks are not interrupted, they may poll threadpool_token_cancelled */
+/* a token may outlive its pool, cancelling it then only marks it */
+threadpool_token_t *threadpool_token_create(threadpool_t *pool);
+void threadpool_token_cancel(threadpool_token_t *token);
+int threadpool_token_cancelled(const threadpool_token_t *token);
+void threadpool_token_release(threadpool_token_t *token);
+/* token of the task running on this thread, NULL if none */
+threadpool_token_t *threadpool_current_token(void);
+
+/* task groups */
+/* waiting on a group only waits for the tasks submitted into it */
+threadpool_group_t *threadpool_group_create(threadpool_t *pool);
+/* block until every task of the group is finished or cancelled */
+/* never call it from a task of the same group */
+void threadpool_group_wait(threadpool_group_t *group);
+size_t threadpool_group_pending(threadpool_group_t *group);
+/* the group must be idle */
+void threadpool_group_destroy(threadpool_group_t *group);
+
+/* dispatch traces */
+/* replay matches tasks by submission number, the program has to submit the same tasks in the same order; */
+/* timer tasks, or submissions from several threads at once, may not line up */
+/* tag limits apply as tasks get ready, replay and simulate may go over max_running */
+/* replay diverges at the first entry for a worker the pool does not have */
+/* seed 0 picks a fixed one */
+threadpool_trace_t *threadpool_trace_create(const threadpool_allocator_t *allocator, uint64_t seed);
+/* one "seq worker resume" line per entry, non zero on write errors */
+int threadpool_trace_save(const threadpool_trace_t *trace, FILE *f);
+/* NULL on malformed input */
+threadpool_trace_t *threadpool_trace_load(const threadpool_allocator_t *allocator, FILE *f);
+void threadpool_trace_destroy(threadpool_trace_t *trace);
+/* replay and simulate start nothing before this, so that submissions made up front get the same numbers */
+void threadpool_trace_start(threadpool_t *pool);
+
+/* strands */
+/* tasks submitted with the same strand in their attributes run one at a time, in submission order, */
+/* a suspended fiber still holding its strand; different strands run in parallel on the pool's workers */
+threadpool_strand_t *threadpool_strand_create(threadpool_t *pool);
+/* block until every task submitted to the strand is finished or cancelled */
+/* never call it from a task of the same strand */
+void threadpool_strand_join(threadpool_strand_t *strand);
+/* the strand must be idle */
+void threadpool_strand_destroy(threadpool_strand_t *strand);
+
+/* executor contexts */
+/* busy contexts share the workers in proportion to their weight */
+threadpool_context_t *threadpool_context_create(threadpool_t *pool, unsigned weight);
+/* block until every task submitted to the context is finished or cancelled */
+void threadpool_context_join(threadpool_context_t *ctx);
+void threadpool_context_stats(threadpool_context_t *ctx, threadpool_context_stats_t *stats);
+/* the context must be idle; contexts left over are freed with the pool */
+void threadpool_context_destroy(threadpool_context_t *ctx);
+
+/* per tag accounting */
+/* each field is read atomically, the four of them are not one snapshot */
+void threadpool_tag_stats(threadpool_t *pool, unsigned tag, threadpool_tag_stats_t *stats);
+/* tasks over the limits of their tag wait aside, other tags keep going */
+/* applies to tasks not dispatched yet, limits NULL lifts them */
+void threadpool_tag_limit(threadpool_t *pool, unsigned tag, const threadpool_tag_limits_t *limits);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _THREADPOOL_H_ */
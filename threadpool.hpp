@@ -0,0 +1,354 @@
+#ifndef _THREADPOOL_HPP_
+#define _THREADPOOL_HPP_
+
+/* typed C++17 front end, header only */
+/* callables and results up to detail::inline_size bytes live in recycled cells, no allocation per task */
+/* with C++20 coroutines, pools and futures are also awaitable */
+
+#include "threadpool.h"
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define THREADPOOL_COROUTINES 1
+#endif
+
+namespace threadpool {
+
+/* the task never ran, its token was cancelled or the pool was shutting down */
+class cancelled_error : public std::runtime_error {
+public:
+    cancelled_error() : std::runtime_error("threadpool: task cancelled") {}
+};
+
+/* the task called threadpool_fail */
+class task_error : public std::runtime_error {
+public:
+    explicit task_error(int code) : std::runtime_error("threadpool: task failed"), code_(code) {}
+    int code() const noexcept { return code_; }
+
+private:
+    int                 code_;
+};
+
+class Pool;
+template <typename R> class Future;
+
+namespace detail {
+
+constexpr std::size_t inline_size = 48;
+
+/* the native code of a future whose task threw */
+constexpr int thrown = -1;
+
+template <typename T>
+constexpr bool fits_inline = sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t);
+
+/* one submission, the callable and then its result */
+struct cell {
+    alignas(std::max_align_t) unsigned char fn[inline_size];
+    alignas(std::max_align_t) unsigned char res[inline_size];
+    void                *fn_heap;
+    void                *res_heap;
+    /* what the callable threw, no result then */
+    std::exception_ptr  error;
+    /* runs the callable, leaves the result in res and destroys the callable */
+    void                (*run)(cell*);
+    /* destroys the callable that never ran */
+    void                (*drop)(cell*);
+    /* free list of the pool */
+    cell                *next;
+};
+
+template <typename T, typename... A>
+T *emplace(unsigned char *buf, void *&heap, A&&... a)
+{
+    if constexpr ( fits_inline<T> ){
+        heap = nullptr;
+        return new (buf) T(std::forward<A>(a)...);
+    }else{
+        T *p = new T(std::forward<A>(a)...);
+        heap = p;
+        return p;
+    }
+}
+
+template <typename T>
+T *slot(unsigned char *buf, void *heap)
+{
+    if constexpr ( fits_inline<T> ) return std::launder(reinterpret_cast<T*>(buf));
+    else return static_cast<T*>(heap);
+}
+
+template <typename T>
+void destroy(unsigned char *buf, void *heap)
+{
+    if constexpr ( fits_inline<T> ) slot<T>(buf, heap)->~T();
+    else delete static_cast<T*>(heap);
+}
+
+template <typename Fn, typename R>
+void run(cell *c)
+{
+    Fn *fn = slot<Fn>(c->fn, c->fn_heap);
+    /* the callable goes whether it returns or throws */
+    struct guard {
+        cell *c;
+        ~guard() { destroy<Fn>(c->fn, c->fn_heap); }
+    } g{ c };
+    if constexpr ( std::is_void_v<R> ){
+        std::invoke(*fn);
+    }else{
+        emplace<R>(c->res, c->res_heap, std::invoke(*fn));
+    }
+}
+
+template <typename Fn>
+void drop(cell *c)
+{
+    destroy<Fn>(c->fn, c->fn_heap);
+}
+
+/* the routine handed to threadpool_gofuture */
+inline void *trampoline(void *args) noexcept
+{
+    cell *c = static_cast<cell*>(args);
+    /* nothing may unwind through the pool's C frames */
+    try {
+        c->run(c);
+    } catch ( ... ) {
+        c->error = std::current_exception();
+        threadpool_fail(thrown);
+    }
+    return c;
+}
+
+#ifdef THREADPOOL_COROUTINES
+/* a task or continuation that picks the coroutine up on a worker */
+inline void resume(void *address)
+{
+    std::coroutine_handle<>::from_address(address).resume();
+}
+
+struct schedule_awaiter {
+    threadpool_t        *pool;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) const { threadpool_goroutine(pool, resume, h.address()); }
+    void await_resume() const noexcept {}
+};
+
+/* a raw future_t, resumes with its value */
+struct native_awaiter {
+    threadpool_t        *pool;
+    future_t            fut;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) const { threadpool_future_then(pool, fut, resume, h.address()); }
+    void *await_resume() const
+    {
+        void *value = nullptr;
+        future_status_t status = threadpool_get_status(pool, fut, &value);
+        if ( status == future_status_cancelled ) throw cancelled_error();
+        if ( status == future_status_error ) throw task_error(static_cast<int>(reinterpret_cast<std::intptr_t>(value)));
+        return value;
+    }
+};
+#endif
+
+} // namespace detail
+
+template <typename R>
+class Future {
+public:
+    Future() = default;
+    Future(Future &&o) noexcept : pool_(o.pool_), fut_(o.fut_), cell_(std::exchange(o.cell_, nullptr)) {}
+    Future &operator=(Future &&o) noexcept
+    {
+        if ( this != &o ){
+            discard();
+            pool_ = o.pool_;
+            fut_ = o.fut_;
+            cell_ = std::exchange(o.cell_, nullptr);
+        }
+        return *this;
+    }
+    Future(const Future&) = delete;
+    Future &operator=(const Future&) = delete;
+    /* waits, a pool future has to be got once to be recycled */
+    ~Future() { discard(); }
+
+    bool valid() const noexcept { return cell_ != nullptr; }
+    future_t native() const noexcept { return fut_; }
+
+    /* blocks, or suspends the fiber in fiber mode */
+    /* rethrows what the task threw, or throws cancelled_error or task_error */
+    R get();
+
+#ifdef THREADPOOL_COROUTINES
+    /* suspends the coroutine, no thread waits; it resumes on a worker */
+    class awaiter;
+    awaiter operator co_await() noexcept;
+#endif
+
+private:
+    friend class Pool;
+    Future(Pool *pool, future_t fut, detail::cell *c) : pool_(pool), fut_(fut), cell_(c) {}
+    void discard() noexcept;
+
+    Pool                *pool_ = nullptr;
+    future_t            fut_ = -1;
+    detail::cell        *cell_ = nullptr;
+};
+
+class Pool {
+public:
+    explicit Pool(std::size_t threads, const threadpool_config_t *config = nullptr)
+        : pool_(threadpool_create_ex(threads, config))
+    {
+        if ( !pool_ ) throw std::invalid_argument("threadpool: no threads or incomplete allocator");
+    }
+    /* drains everything already submitted */
+    ~Pool()
+    {
+        threadpool_shutdown(pool_, threadpool_shutdown_drain, -1);
+        while ( free_ ){
+            delete std::exchange(free_, free_->next);
+        }
+    }
+    Pool(const Pool&) = delete;
+    Pool &operator=(const Pool&) = delete;
+
+    /* f and args are decay copied into the task, the result is returned by value */
+    template <typename F, typename... Args>
+    auto submit(F &&f, Args&&... args) -> Future<std::decay_t<std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>>>
+    {
+        using R = std::decay_t<std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>>;
+        detail::cell *c = acquire();
+        if constexpr ( sizeof...(Args) == 0 ){
+            using Fn = std::decay_t<F>;
+            detail::emplace<Fn>(c->fn, c->fn_heap, std::forward<F>(f));
+            c->run = detail::run<Fn, R>;
+            c->drop = detail::drop<Fn>;
+        }else{
+            auto bound = [f = std::decay_t<F>(std::forward<F>(f)),
+                          args = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...)]() mutable -> R {
+                return std::apply(std::move(f), std::move(args));
+            };
+            using Fn = decltype(bound);
+            detail::emplace<Fn>(c->fn, c->fn_heap, std::move(bound));
+            c->run = detail::run<Fn, R>;
+            c->drop = detail::drop<Fn>;
+        }
+        return Future<R>(this, threadpool_gofuture(pool_, detail::trampoline, c), c);
+    }
+
+    void join() { threadpool_join(pool_); }
+    threadpool_t *get() const noexcept { return pool_; }
+
+#ifdef THREADPOOL_COROUTINES
+    /* co_await pool.schedule() continues the coroutine on a worker */
+    detail::schedule_awaiter schedule() noexcept { return { pool_ }; }
+    /* co_await pool.await_future(fut) for futures from the C API, gives their void* */
+    detail::native_awaiter await_future(future_t fut) noexcept { return { pool_, fut }; }
+#endif
+
+private:
+    template <typename> friend class Future;
+
+    detail::cell *acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lock(free_lock_);
+            if ( free_ ) return std::exchange(free_, free_->next);
+        }
+        return new detail::cell;
+    }
+
+    void recycle(detail::cell *c)
+    {
+        std::lock_guard<std::mutex> lock(free_lock_);
+        c->next = free_;
+        free_ = c;
+    }
+
+    threadpool_t        *pool_;
+    std::mutex          free_lock_;
+    detail::cell        *free_ = nullptr;
+};
+
+template <typename R>
+R Future<R>::get()
+{
+    detail::cell *c = std::exchange(cell_, nullptr);
+    void *value = nullptr;
+    future_status_t status = threadpool_get_status(pool_->get(), fut_, &value);
+    if ( status == future_status_cancelled ){
+        c->drop(c);
+        pool_->recycle(c);
+        throw cancelled_error();
+    }
+    if ( status == future_status_error ){
+        std::exception_ptr error = std::exchange(c->error, nullptr);
+        /* threadpool_fail without a throw, the callable still returned */
+        if constexpr ( !std::is_void_v<R> ){
+            if ( !error ) detail::destroy<R>(c->res, c->res_heap);
+        }
+        pool_->recycle(c);
+        if ( error ) std::rethrow_exception(error);
+        throw task_error(static_cast<int>(reinterpret_cast<std::intptr_t>(value)));
+    }
+    if constexpr ( std::is_void_v<R> ){
+        pool_->recycle(c);
+    }else{
+        R *res = detail::slot<R>(c->res, c->res_heap);
+        R out(std::move(*res));
+        detail::destroy<R>(c->res, c->res_heap);
+        pool_->recycle(c);
+        return out;
+    }
+}
+
+template <typename R>
+void Future<R>::discard() noexcept
+{
+    if ( !cell_ ) return;
+    try {
+        get();
+    } catch ( ... ) {
+    }
+}
+
+#ifdef THREADPOOL_COROUTINES
+template <typename R>
+class Future<R>::awaiter {
+public:
+    explicit awaiter(Future *self) noexcept : self_(self) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) const
+    {
+        threadpool_future_then(self_->pool_->get(), self_->fut_, detail::resume, h.address());
+    }
+    /* the future is resolved by now, get does not block */
+    R await_resume() { return self_->get(); }
+
+private:
+    Future              *self_;
+};
+
+template <typename R>
+typename Future<R>::awaiter Future<R>::operator co_await() noexcept
+{
+    return awaiter(this);
+}
+#endif
+
+} // namespace threadpool
+
+#endif /* _THREADPOOL_HPP_ */
@@ -0,0 +1,121 @@
+#include "timerwheel.h"
+#include <string.h>
+
+#define LEVEL_SHIFT(l)      (TIMER_WHEEL_BITS * (l))
+#define SLOT_MASK           (TIMER_WHEEL_SLOTS - 1)
+/* ticks the whole wheel covers */
+#define WHEEL_SPAN          (1ull << LEVEL_SHIFT(TIMER_WHEEL_LEVELS))
+
+static void
+_wheel_link(timer_wheel_t *tw, timer_node_t *node)
+{
+    /* during a cascade an expiry of exactly now still lands in the slot about to fire */
+    uint64_t expires = node->expires < tw->now ? tw->now : node->expires;
+    uint64_t delta = expires - tw->now;
+    if ( delta >= WHEEL_SPAN ){
+        /* parked at the top, every cascade brings it closer */
+        expires = tw->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    int level = 0;
+    while ( delta >= (1ull << LEVEL_SHIFT(level + 1)) ) level++;
+
+    timer_node_t **head = &tw->slots[level][ (expires >> LEVEL_SHIFT(level)) & SLOT_MASK ];
+    node->next = *head;
+    if ( node->next ) node->next->pprev = &node->next;
+    node->pprev = head;
+    *head = node;
+}
+
+static void
+_wheel_unlink(timer_node_t *node)
+{
+    *node->pprev = node->next;
+    if ( node->next ) node->next->pprev = node->pprev;
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+/* moves a whole higher level slot down, relative to the current tick */
+static void
+_wheel_cascade(timer_wheel_t *tw, int level)
+{
+    timer_node_t **head = &tw->slots[level][ (tw->now >> LEVEL_SHIFT(level)) & SLOT_MASK ];
+    timer_node_t *node = *head;
+    *head = NULL;
+    while ( node ){
+        timer_node_t *next = node->next;
+        _wheel_link(tw, node);
+        node = next;
+    }
+}
+
+void
+timer_wheel_init(timer_wheel_t *tw, uint64_t now)
+{
+    tw->now = now;
+    tw->count = 0;
+    memset(tw->slots, 0, sizeof(tw->slots));
+}
+
+void
+timer_wheel_add(timer_wheel_t *tw, timer_node_t *node, uint64_t expires)
+{
+    /* tw->now itself is already handled */
+    node->expires = expires > tw->now ? expires : tw->now + 1;
+    _wheel_link(tw, node);
+    tw->count++;
+}
+
+void
+timer_wheel_del(timer_wheel_t *tw, timer_node_t *node)
+{
+    _wheel_unlink(node);
+    tw->count--;
+}
+
+void
+timer_wheel_advance(timer_wheel_t *tw, uint64_t now, void (*expire)(timer_node_t*, void*), void *arg)
+{
+    while ( tw->now < now ){
+        if ( tw->count == 0 ){
+            tw->now = now;
+            return;
+        }
+        tw->now++;
+        for ( int level = 1; level < TIMER_WHEEL_LEVELS; level++ ){
+            if ( tw->now & ((1ull << LEVEL_SHIFT(level)) - 1) ) break;
+            _wheel_cascade(tw, level);
+        }
+
+        timer_node_t **head = &tw->slots[0][ tw->now & SLOT_MASK ];
+        timer_node_t *node;
+        while ( (node = *head) != NULL ){
+            timer_wheel_del(tw, node);
+            expire(node, arg);
+        }
+    }
+}
+
+uint64_t
+timer_wheel_next(timer_wheel_t *tw)
+{
+    /* the nearest busy level 0 slot, or the next cascade, whichever comes first */
+    for ( uint64_t t = tw->now + 1; ; t++ ){
+        if ( tw->slots[0][ t & SLOT_MASK ] || (t & SLOT_MASK) == 0 ) return t;
+    }
+}
+
+void
+timer_wheel_clear(timer_wheel_t *tw, void (*fn)(timer_node_t*, void*), void *arg)
+{
+    for ( int level = 0; level < TIMER_WHEEL_LEVELS; level++ ){
+        for ( size_t i = 0; i < TIMER_WHEEL_SLOTS; i++ ){
+            timer_node_t *node;
+            while ( (node = tw->slots[level][i]) != NULL ){
+                timer_wheel_del(tw, node);
+                fn(node, arg);
+            }
+        }
+    }
+}
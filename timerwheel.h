@@ -0,0 +1,40 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* hierarchical timer wheel, one tick per millisecond */
+/* level l slots are 64^l ticks wide, 4 levels reach about 4.6 hours, later ones wait at the top */
+
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4
+
+typedef struct timer_node_s {
+    uint64_t            expires;
+    struct timer_node_s *next;
+    /* the next field pointing at this node, unlinking needs no walk */
+    struct timer_node_s **pprev;
+} timer_node_t;
+
+typedef struct timer_wheel_s {
+    /* every tick up to now has been handled */
+    uint64_t            now;
+    size_t              count;
+    timer_node_t        *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t *tw, uint64_t now);
+/* an expiry not after tw->now fires on the next advance */
+void timer_wheel_add(timer_wheel_t *tw, timer_node_t *node, uint64_t expires);
+/* O(1) */
+void timer_wheel_del(timer_wheel_t *tw, timer_node_t *node);
+/* expire is called for every due node, already unlinked so it may add it back */
+void timer_wheel_advance(timer_wheel_t *tw, uint64_t now, void (*expire)(timer_node_t*, void*), void *arg);
+/* no later than the next tick that has work, count must not be 0 */
+uint64_t timer_wheel_next(timer_wheel_t *tw);
+/* unlinks everything, fn may free the nodes */
+void timer_wheel_clear(timer_wheel_t *tw, void (*fn)(timer_node_t*, void*), void *arg);
+
+#endif /* _TIMERWHEEL_H_ */